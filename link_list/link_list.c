@@ -1,5 +1,8 @@
 #include "link_list.h"
 
+// 节点池默认每块节点数
+#define LL_SLAB_NODES 256
+
 /**
  * @brief 初始化链表
  * @param list 链表指针
@@ -11,6 +14,72 @@ void ll_init(LinkedList *list)
     list->head = NULL;
     list->tail = NULL;
     list->size = 0;
+    list->pool.slabs = NULL;
+    list->pool.free_list = NULL;
+    list->pool.slab_nodes = 0;
+    list->pool.slab_used = 0;
+}
+
+/**
+ * @brief 初始化使用节点池的链表，节点从块中分配，ll_clear整块释放
+ * @param list 链表指针
+ * @param slab_nodes 每块节点数，0使用默认值
+ */
+void ll_init_pool(LinkedList *list, size_t slab_nodes)
+{
+    if (list == NULL) return;
+
+    ll_init(list);
+    list->pool.slab_nodes = (slab_nodes > 0) ? slab_nodes : LL_SLAB_NODES;
+}
+
+/**
+ * @brief 为链表分配节点：优先取空闲链表，其次从当前块切分，块用完再分配新块
+ * @param list 链表指针
+ * @param data 节点数据
+ * @return 成功返回节点指针，失败返回NULL
+ */
+static ListNode* ll_alloc_node(LinkedList *list, int data)
+{
+    ListNodePool *pool = &list->pool;
+    if (pool->slab_nodes == 0) return ll_create(data);
+
+    ListNode *node = pool->free_list;
+    if (node != NULL) {
+        pool->free_list = node->next;
+    } else {
+        if (pool->slabs == NULL || pool->slab_used == pool->slab_nodes) {
+            ListNodeSlab *slab = (ListNodeSlab*)malloc(sizeof(ListNodeSlab) + sizeof(ListNode) * pool->slab_nodes);
+            if (slab == NULL) {
+                perror("Memory allocation failed");
+                return NULL;
+            }
+            slab->next = pool->slabs;
+            pool->slabs = slab;
+            pool->slab_used = 0;
+        }
+        node = &pool->slabs->nodes[pool->slab_used++];
+    }
+
+    node->data = data;
+    node->next = NULL;
+    return node;
+}
+
+/**
+ * @brief 释放链表节点，使用节点池时放回空闲链表
+ * @param list 链表指针
+ * @param node 节点指针
+ */
+static void ll_free_node(LinkedList *list, ListNode *node)
+{
+    if (list->pool.slab_nodes == 0) {
+        free(node);
+        return;
+    }
+
+    node->next = list->pool.free_list;
+    list->pool.free_list = node;
 }
 
 /**
@@ -41,7 +110,7 @@ bool ll_insert_head(LinkedList *list, int data)
 {
     if (list == NULL) return false;
     
-    ListNode *newNode = createListNode(data);
+    ListNode *newNode = ll_alloc_node(list, data);
     if (newNode == NULL) return false;
     
     newNode->next = list->head;
@@ -66,7 +135,7 @@ bool ll_insert_tail(LinkedList *list, int data)
 {
     if (list == NULL) return false;
     
-    ListNode *newNode = createListNode(data);
+    ListNode *newNode = ll_alloc_node(list, data);
     if (newNode == NULL) return false;
     
     if (list->tail == NULL) {
@@ -98,7 +167,7 @@ bool ll_insert_index(LinkedList *list, size_t index, int data)
     if (index == 0) return ll_insert_head(list, data);
     if (index == list->size) return ll_insert_tail(list, data);
     
-    ListNode *newNode = createListNode(data);
+    ListNode *newNode = ll_alloc_node(list, data);
     if (newNode == NULL) return false;
     
     // 找到插入位置的前一个节点
@@ -127,7 +196,7 @@ int ll_delete_head(LinkedList *list)
     int data = temp->data;
     
     list->head = list->head->next;
-    free(temp);
+    ll_free_node(list, temp);
     
     // 如果删除后链表为空，更新tail
     if (list->head == NULL) {
@@ -151,7 +220,7 @@ int ll_delete_tail(LinkedList *list)
     
     // 只有一个节点的情况
     if (list->head == list->tail) {
-        free(list->head);
+        ll_free_node(list, list->head);
         list->head = NULL;
         list->tail = NULL;
     } else {
@@ -161,7 +230,7 @@ int ll_delete_tail(LinkedList *list)
             prev = prev->next;
         }
         
-        free(list->tail);
+        ll_free_node(list, list->tail);
         prev->next = NULL;
         list->tail = prev;
     }
@@ -182,7 +251,7 @@ bool ll_delete_by_value(LinkedList *list, int data)
     
     // 处理头节点匹配的情况
     if (list->head->data == data) {
-        deleteAtHead(list);
+        ll_delete_head(list);
         return true;
     }
     
@@ -198,7 +267,7 @@ bool ll_delete_by_value(LinkedList *list, int data)
                 list->tail = prev;
             }
             
-            free(current);
+            ll_free_node(list, current);
             list->size--;
             return true;
         }
@@ -282,14 +351,162 @@ void ll_clear(LinkedList *list)
 {
     if (list == NULL) return;
     
-    ListNode *current = list->head;
-    while (current != NULL) {
-        ListNode *temp = current;
-        current = current->next;
-        free(temp);
+    if (list->pool.slab_nodes > 0) {
+        // 节点都在块中，按块释放，不必逐个遍历节点
+        ListNodeSlab *slab = list->pool.slabs;
+        while (slab != NULL) {
+            ListNodeSlab *temp = slab;
+            slab = slab->next;
+            free(temp);
+        }
+        list->pool.slabs = NULL;
+        list->pool.free_list = NULL;
+        list->pool.slab_used = 0;
+    } else {
+        ListNode *current = list->head;
+        while (current != NULL) {
+            ListNode *temp = current;
+            current = current->next;
+            free(temp);
+        }
     }
     
     list->head = NULL;
     list->tail = NULL;
     list->size = 0;
 }
+
+/**
+ * @brief 初始化链表头或独立节点
+ * @param node 节点指针
+ */
+void dl_init(DListNode *node)
+{
+    node->prev = node;
+    node->next = node;
+}
+
+/**
+ * @brief 判断链表是否为空，O(1)
+ * @param head 链表头指针
+ * @return 为空返回true
+ */
+bool dl_empty(const DListNode *head)
+{
+    return head->next == head;
+}
+
+/**
+ * @brief 在pos之后插入node，O(1)
+ * @param pos 位置节点（可以是链表头）
+ * @param node 要插入的节点
+ */
+void dl_insert_after(DListNode *pos, DListNode *node)
+{
+    node->prev = pos;
+    node->next = pos->next;
+    pos->next->prev = node;
+    pos->next = node;
+}
+
+/**
+ * @brief 在pos之前插入node，O(1)
+ * @param pos 位置节点（可以是链表头）
+ * @param node 要插入的节点
+ */
+void dl_insert_before(DListNode *pos, DListNode *node)
+{
+    dl_insert_after(pos->prev, node);
+}
+
+/**
+ * @brief 插入到链表头部，O(1)
+ * @param head 链表头指针
+ * @param node 要插入的节点
+ */
+void dl_push_front(DListNode *head, DListNode *node)
+{
+    dl_insert_after(head, node);
+}
+
+/**
+ * @brief 插入到链表尾部，O(1)
+ * @param head 链表头指针
+ * @param node 要插入的节点
+ */
+void dl_push_back(DListNode *head, DListNode *node)
+{
+    dl_insert_after(head->prev, node);
+}
+
+/**
+ * @brief 从所在链表中摘除节点，O(1)，摘除后节点指向自身
+ * @param node 要摘除的节点
+ */
+void dl_unlink(DListNode *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    // 指向自身，重复摘除也安全
+    node->prev = node;
+    node->next = node;
+}
+
+/**
+ * @brief 摘除并返回第一个节点，O(1)
+ * @param head 链表头指针
+ * @return 空链表返回NULL
+ */
+DListNode* dl_pop_front(DListNode *head)
+{
+    if (dl_empty(head)) return NULL;
+
+    DListNode *node = head->next;
+    dl_unlink(node);
+    return node;
+}
+
+/**
+ * @brief 摘除并返回最后一个节点，O(1)
+ * @param head 链表头指针
+ * @return 空链表返回NULL
+ */
+DListNode* dl_pop_back(DListNode *head)
+{
+    if (dl_empty(head)) return NULL;
+
+    DListNode *node = head->prev;
+    dl_unlink(node);
+    return node;
+}
+
+/**
+ * @brief 把节点移到链表头部，O(1)，用于LRU
+ * @param head 链表头指针
+ * @param node 已在链表中的节点
+ */
+void dl_move_front(DListNode *head, DListNode *node)
+{
+    dl_unlink(node);
+    dl_insert_after(head, node);
+}
+
+/**
+ * @brief 把src的全部节点按顺序接到dst尾部，O(1)，src变为空
+ * @param dst 目标链表头指针
+ * @param src 源链表头指针
+ */
+void dl_splice(DListNode *dst, DListNode *src)
+{
+    if (dl_empty(src)) return;
+
+    DListNode *first = src->next;
+    DListNode *last = src->prev;
+
+    first->prev = dst->prev;
+    dst->prev->next = first;
+    last->next = dst;
+    dst->prev = last;
+
+    dl_init(src);
+}
@@ -7,6 +7,7 @@ extern "C" {
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdbool.h>
 
 // 链表节点结构
@@ -15,18 +16,136 @@ typedef struct ListNode {
     struct ListNode *next;  // 指向下一个节点的指针
 } ListNode;
 
+// 节点块，一次分配slab_nodes个节点
+typedef struct ListNodeSlab {
+    struct ListNodeSlab *next; // 下一个块
+    ListNode nodes[];          // 节点数组
+} ListNodeSlab;
+
+// 节点池：按块批量分配节点，删除的节点进入空闲链表复用
+typedef struct {
+    ListNodeSlab *slabs;    // 已分配的块，最新的在前
+    ListNode *free_list;    // 空闲节点，通过next串联
+    size_t slab_nodes;      // 每块节点数，0表示不使用节点池
+    size_t slab_used;       // 最新块中已分出的节点数
+} ListNodePool;
+
 // 链表管理结构
 typedef struct {
     ListNode *head;         // 链表头节点
     ListNode *tail;         // 链表尾节点
     size_t size;            // 链表长度
+    ListNodePool pool;      // 节点池（可选）
 } LinkedList;
 
+// 侵入式双向链表节点，嵌入用户结构体中使用。
+// 链表头也是一个DListNode，空链表的头指向自身（循环链表）
+typedef struct DListNode {
+    struct DListNode *prev; // 前一个节点
+    struct DListNode *next; // 后一个节点
+} DListNode;
+
+/**
+ * @brief 由节点指针得到所在的用户结构体指针
+ * @param node 节点指针
+ * @param type 用户结构体类型
+ * @param member 节点在结构体中的成员名
+ */
+#define dl_entry(node, type, member) ((type *)((char *)(node) - offsetof(type, member)))
+
+/**
+ * @brief 遍历链表，循环体中不能删除node
+ * @param node 迭代变量(DListNode *)
+ * @param head 链表头指针
+ */
+#define dl_for_each(node, head) \
+    for ((node) = (head)->next; (node) != (head); (node) = (node)->next)
+
+/**
+ * @brief 遍历链表，循环体中可以删除node
+ * @param node 迭代变量(DListNode *)
+ * @param tmp 临时变量(DListNode *)
+ * @param head 链表头指针
+ */
+#define dl_for_each_safe(node, tmp, head) \
+    for ((node) = (head)->next, (tmp) = (node)->next; (node) != (head); (node) = (tmp), (tmp) = (node)->next)
+
+/**
+ * @brief 初始化链表头或独立节点
+ * @param node 节点指针
+ */
+void dl_init(DListNode *node);
+/**
+ * @brief 判断链表是否为空，O(1)
+ * @param head 链表头指针
+ * @return 为空返回true
+ */
+bool dl_empty(const DListNode *head);
+/**
+ * @brief 在pos之后插入node，O(1)
+ * @param pos 位置节点（可以是链表头）
+ * @param node 要插入的节点
+ */
+void dl_insert_after(DListNode *pos, DListNode *node);
+/**
+ * @brief 在pos之前插入node，O(1)
+ * @param pos 位置节点（可以是链表头）
+ * @param node 要插入的节点
+ */
+void dl_insert_before(DListNode *pos, DListNode *node);
+/**
+ * @brief 插入到链表头部，O(1)
+ * @param head 链表头指针
+ * @param node 要插入的节点
+ */
+void dl_push_front(DListNode *head, DListNode *node);
+/**
+ * @brief 插入到链表尾部，O(1)
+ * @param head 链表头指针
+ * @param node 要插入的节点
+ */
+void dl_push_back(DListNode *head, DListNode *node);
+/**
+ * @brief 从所在链表中摘除节点，O(1)，摘除后节点指向自身
+ * @param node 要摘除的节点
+ */
+void dl_unlink(DListNode *node);
+/**
+ * @brief 摘除并返回第一个节点，O(1)
+ * @param head 链表头指针
+ * @return 空链表返回NULL
+ */
+DListNode* dl_pop_front(DListNode *head);
+/**
+ * @brief 摘除并返回最后一个节点，O(1)
+ * @param head 链表头指针
+ * @return 空链表返回NULL
+ */
+DListNode* dl_pop_back(DListNode *head);
+/**
+ * @brief 把节点移到链表头部，O(1)，用于LRU
+ * @param head 链表头指针
+ * @param node 已在链表中的节点
+ */
+void dl_move_front(DListNode *head, DListNode *node);
+/**
+ * @brief 把src的全部节点按顺序接到dst尾部，O(1)，src变为空
+ * @param dst 目标链表头指针
+ * @param src 源链表头指针
+ */
+void dl_splice(DListNode *dst, DListNode *src);
+
 /**
  * @brief 初始化链表
  * @param list 链表指针
  */
 void ll_init(LinkedList *list);
+/**
+ * @brief 初始化使用节点池的链表，节点从块中分配，ll_clear整块释放
+ * @param list 链表指针
+ * @param slab_nodes 每块节点数，0使用默认值
+ */
+void ll_init_pool(LinkedList *list, size_t slab_nodes);
 /**
  * @brief 创建新节点
  * @param data 节点数据
@@ -95,7 +214,7 @@ bool ll_contains(LinkedList *list, int data);
  */
 void ll_print(LinkedList *list);
 /**
- * @brief 清空链表，释放所有节点
+ * @brief 清空链表，释放所有节点（使用节点池时整块释放）
  * @param list 链表指针
  */
 void ll_clear(LinkedList *list);
@@ -1,25 +1,78 @@
+#define _GNU_SOURCE
 #include "queue.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
 
-Queue* queue_create(int capacity)
+// Smallest power of two >= n, 0 when that does not fit in size_t
+static size_t queue_round_up(size_t n)
+{
+    size_t slots = 1;
+    while (slots < n) {
+        if (slots > ((size_t)-1) / 2) {
+            return 0;
+        }
+        slots <<= 1;
+    }
+    return slots;
+}
+
+static Queue* queue_alloc(size_t slots, size_t capacity)
 {
     Queue *queue = (Queue*)malloc(sizeof(Queue));
     if (queue == NULL) {
         return NULL;
     }
-    
-    queue->items = (void**)malloc(sizeof(void*) * capacity);
+
+    queue->items = (void**)malloc(sizeof(void*) * slots);
     if (queue->items == NULL) {
         free(queue);
         return NULL;
     }
-    
+
     queue->front = 0;
-    queue->rear = -1;
+    queue->rear = 0;
     queue->capacity = capacity;
     queue->size = 0;
-    
+    queue->mask = slots - 1;
+    queue->min_slots = slots;
+    queue->growable = false;
+    queue->shrink = false;
+
+    return queue;
+}
+
+Queue* queue_create(int capacity)
+{
+    if (capacity < 0) {
+        return NULL;
+    }
+
+    // The array is rounded up so indices wrap with a mask, capacity still
+    // bounds the number of elements
+    size_t slots = queue_round_up((size_t)capacity);
+    return queue_alloc(slots, (size_t)capacity);
+}
+
+Queue* queue_create_growable(size_t initial_capacity, size_t max_capacity, bool shrink)
+{
+    size_t capacity = (max_capacity > 0) ? max_capacity : ((size_t)-1) / sizeof(void*);
+    if (initial_capacity > capacity) {
+        initial_capacity = capacity;
+    }
+
+    size_t slots = queue_round_up(initial_capacity);
+    if (slots == 0) {
+        return NULL;
+    }
+
+    Queue *queue = queue_alloc(slots, capacity);
+    if (queue != NULL) {
+        queue->growable = true;
+        queue->shrink = shrink;
+    }
     return queue;
 }
 
@@ -31,16 +84,47 @@ void queue_destroy(Queue *queue)
     }
 }
 
+// Move the elements to a new array of slots entries, unwrapped to the front
+static bool queue_resize(Queue *queue, size_t slots)
+{
+    void **items = (void**)malloc(sizeof(void*) * slots);
+    if (items == NULL) {
+        return false;
+    }
+
+    size_t first = queue->mask + 1 - queue->front;
+    if (first > queue->size) {
+        first = queue->size;
+    }
+    memcpy(items, queue->items + queue->front, sizeof(void*) * first);
+    memcpy(items + first, queue->items, sizeof(void*) * (queue->size - first));
+
+    free(queue->items);
+    queue->items = items;
+    queue->front = 0;
+    queue->rear = queue->size & (slots - 1);
+    queue->mask = slots - 1;
+    return true;
+}
+
 bool queue_enqueue(Queue *queue, void *item)
 {
     if (queue_is_full(queue)) {
         return false;
     }
-    
-    queue->rear = (queue->rear + 1) % queue->capacity;
+
+    // The array may be smaller than capacity in growable mode
+    if (queue->size == queue->mask + 1) {
+        size_t slots = queue->mask + 1;
+        if (slots > ((size_t)-1) / 2 / sizeof(void*) || !queue_resize(queue, slots * 2)) {
+            return false;
+        }
+    }
+
     queue->items[queue->rear] = item;
+    queue->rear = (queue->rear + 1) & queue->mask;
     queue->size++;
-    
+
     return true;
 }
 
@@ -49,11 +133,18 @@ void* queue_dequeue(Queue *queue)
     if (queue_is_empty(queue)) {
         return NULL;
     }
-    
+
     void *item = queue->items[queue->front];
-    queue->front = (queue->front + 1) % queue->capacity;
+    queue->front = (queue->front + 1) & queue->mask;
     queue->size--;
-    
+
+    // Shrinking at a quarter rather than half keeps a queue hovering around
+    // a boundary from resizing on every operation. A failed resize just
+    // keeps the larger array.
+    if (queue->shrink && queue->mask + 1 > queue->min_slots && queue->size <= (queue->mask + 1) / 4) {
+        queue_resize(queue, (queue->mask + 1) / 2);
+    }
+
     return item;
 }
 
@@ -75,7 +166,234 @@ bool queue_is_full(Queue *queue)
     return queue->size == queue->capacity;
 }
 
-int queue_size(Queue *queue)
+size_t queue_size(Queue *queue)
 {
     return queue->size;
-}
\ No newline at end of file
+}
+
+BlockingQueue* blocking_queue_create(int capacity)
+{
+    if (capacity <= 0) {
+        return NULL;
+    }
+
+    BlockingQueue *queue = (BlockingQueue*)malloc(sizeof(BlockingQueue));
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    queue->items = (void**)malloc(sizeof(void*) * capacity);
+    if (queue->items == NULL) {
+        free(queue);
+        return NULL;
+    }
+
+    // Timed waits use the monotonic clock
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    int err = pthread_mutex_init(&queue->head_lock, NULL) |
+              pthread_mutex_init(&queue->tail_lock, NULL) |
+              pthread_cond_init(&queue->not_empty, &condattr) |
+              pthread_cond_init(&queue->not_full, &condattr);
+    pthread_condattr_destroy(&condattr);
+    if (err != 0) {
+        free(queue->items);
+        free(queue);
+        return NULL;
+    }
+
+    queue->capacity = capacity;
+    queue->size = 0;
+    queue->closed = false;
+    queue->front = 0;
+    queue->rear = 0;
+
+    return queue;
+}
+
+void blocking_queue_destroy(BlockingQueue *queue)
+{
+    if (queue != NULL) {
+        pthread_mutex_destroy(&queue->head_lock);
+        pthread_mutex_destroy(&queue->tail_lock);
+        pthread_cond_destroy(&queue->not_empty);
+        pthread_cond_destroy(&queue->not_full);
+        free(queue->items);
+        free(queue);
+    }
+}
+
+// Absolute CLOCK_MONOTONIC time timeout_ms from now
+static void blocking_queue_deadline(struct timespec *deadline, int timeout_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// Wait on cond until ready() or the queue closes, lock held. Producers give
+// up on close at once, consumers (drain) only once the queue is empty.
+// Returns QUEUE_OK when ready, else QUEUE_TIMEOUT or QUEUE_CLOSED.
+static int blocking_queue_wait(BlockingQueue *queue, pthread_cond_t *cond, pthread_mutex_t *lock,
+                               bool (*ready)(BlockingQueue *), bool drain, int timeout_ms)
+{
+    struct timespec deadline;
+    if (timeout_ms > 0) {
+        blocking_queue_deadline(&deadline, timeout_ms);
+    }
+
+    bool expired = (timeout_ms == 0);
+    for (;;) {
+        // closed first, so size is read after everything enqueued before close()
+        bool closed = __atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE);
+        if (closed && !drain) {
+            return QUEUE_CLOSED;
+        }
+        if (ready(queue)) {
+            return QUEUE_OK;
+        }
+        if (closed) {
+            return QUEUE_CLOSED;
+        }
+        if (expired) {
+            return QUEUE_TIMEOUT;
+        }
+
+        if (timeout_ms < 0) {
+            pthread_cond_wait(cond, lock);
+        } else if (pthread_cond_timedwait(cond, lock, &deadline) == ETIMEDOUT) {
+            expired = true;
+        }
+    }
+}
+
+static bool blocking_queue_has_room(BlockingQueue *queue)
+{
+    return __atomic_load_n(&queue->size, __ATOMIC_ACQUIRE) < queue->capacity;
+}
+
+static bool blocking_queue_has_items(BlockingQueue *queue)
+{
+    return __atomic_load_n(&queue->size, __ATOMIC_ACQUIRE) > 0;
+}
+
+// Wake one waiter on the other side. Taking its lock orders the signal
+// after a waiter's check of size, so the wakeup cannot be lost.
+static void blocking_queue_signal(pthread_mutex_t *lock, pthread_cond_t *cond)
+{
+    pthread_mutex_lock(lock);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(lock);
+}
+
+int blocking_queue_enqueue_timed(BlockingQueue *queue, void *item, int timeout_ms)
+{
+    pthread_mutex_lock(&queue->tail_lock);
+    int ret = blocking_queue_wait(queue, &queue->not_full, &queue->tail_lock,
+                                  blocking_queue_has_room, false, timeout_ms);
+    if (ret != QUEUE_OK) {
+        pthread_mutex_unlock(&queue->tail_lock);
+        return ret;
+    }
+
+    queue->items[queue->rear] = item;
+    if (++queue->rear == queue->capacity) {
+        queue->rear = 0;
+    }
+    // Publishes the element to consumers
+    int size = __atomic_fetch_add(&queue->size, 1, __ATOMIC_ACQ_REL);
+    // Pass the wakeup on to the next producer while room is left
+    if (size + 1 < queue->capacity) {
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->tail_lock);
+
+    // Consumers only sleep on an empty queue
+    if (size == 0) {
+        blocking_queue_signal(&queue->head_lock, &queue->not_empty);
+    }
+    return QUEUE_OK;
+}
+
+int blocking_queue_dequeue_many(BlockingQueue *queue, void **items, int max, int timeout_ms)
+{
+    if (max <= 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&queue->head_lock);
+    int ret = blocking_queue_wait(queue, &queue->not_empty, &queue->head_lock,
+                                  blocking_queue_has_items, true, timeout_ms);
+    if (ret != QUEUE_OK) {
+        pthread_mutex_unlock(&queue->head_lock);
+        return ret;
+    }
+
+    int count = __atomic_load_n(&queue->size, __ATOMIC_ACQUIRE);
+    if (count > max) {
+        count = max;
+    }
+    for (int i = 0; i < count; i++) {
+        items[i] = queue->items[queue->front];
+        if (++queue->front == queue->capacity) {
+            queue->front = 0;
+        }
+    }
+    // Hands the slots back to producers
+    int size = __atomic_fetch_sub(&queue->size, count, __ATOMIC_ACQ_REL);
+    if (size - count > 0) {
+        pthread_cond_signal(&queue->not_empty);
+    }
+    pthread_mutex_unlock(&queue->head_lock);
+
+    // Producers only sleep on a full queue
+    if (size == queue->capacity) {
+        blocking_queue_signal(&queue->tail_lock, &queue->not_full);
+    }
+    return count;
+}
+
+int blocking_queue_dequeue_timed(BlockingQueue *queue, void **item, int timeout_ms)
+{
+    int ret = blocking_queue_dequeue_many(queue, item, 1, timeout_ms);
+    return ret > 0 ? QUEUE_OK : ret;
+}
+
+int blocking_queue_enqueue(BlockingQueue *queue, void *item)
+{
+    return blocking_queue_enqueue_timed(queue, item, -1);
+}
+
+int blocking_queue_dequeue(BlockingQueue *queue, void **item)
+{
+    return blocking_queue_dequeue_timed(queue, item, -1);
+}
+
+void blocking_queue_close(BlockingQueue *queue)
+{
+    // Under the producers' lock, so no enqueue is half done when consumers
+    // see the flag
+    pthread_mutex_lock(&queue->tail_lock);
+    __atomic_store_n(&queue->closed, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->tail_lock);
+
+    pthread_mutex_lock(&queue->head_lock);
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->head_lock);
+}
+
+bool blocking_queue_is_closed(BlockingQueue *queue)
+{
+    return __atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE);
+}
+
+int blocking_queue_size(BlockingQueue *queue)
+{
+    return __atomic_load_n(&queue->size, __ATOMIC_RELAXED);
+}
@@ -5,27 +5,212 @@
 extern "C" {
 #endif
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+
+#define QUEUE_CACHE_LINE 64
+
+// Return codes of the blocking queue
+#define QUEUE_OK 0
+#define QUEUE_TIMEOUT -1   // Still full (enqueue) or empty (dequeue) when the timeout expired
+#define QUEUE_CLOSED -2    // Closed, and for dequeue also drained
 
 // Queue structure definition
 typedef struct Queue {
-    void **items;      // Array to store queue elements (using void* for generic type)
-    int front;         // Index of the front element
-    int rear;          // Index of the rear element
-    int capacity;      // Maximum capacity of the queue
-    int size;          // Current number of elements in the queue
+    void **items;      // Array to store queue elements (using void* for generic type),
+                       // mask + 1 of them, a power of two
+    size_t front;      // Index of the front element
+    size_t rear;       // Index of the next free slot
+    size_t capacity;   // Maximum capacity of the queue
+    size_t size;       // Current number of elements in the queue
+    size_t mask;       // Array length - 1
+    size_t min_slots;  // Array length a growable queue never shrinks below
+    bool growable;     // Double the array when full, up to capacity
+    bool shrink;       // Halve the array of a growable queue when a quarter full
 } Queue;
 
+// Thread-safe bounded queue. Producers and consumers take separate locks and
+// meet only through the atomic size, so an enqueue and a dequeue never
+// contend unless the queue is empty or full.
+typedef struct BlockingQueue {
+    void **items;             // Circular array of capacity elements
+    int capacity;
+    int size;                 // Current number of elements, updated atomically
+    bool closed;              // Set once by blocking_queue_close
+
+    char pad0[QUEUE_CACHE_LINE];
+    pthread_mutex_t head_lock; // Held by consumers
+    pthread_cond_t not_empty;
+    int front;                // Index of the next element to dequeue
+
+    char pad1[QUEUE_CACHE_LINE];
+    pthread_mutex_t tail_lock; // Held by producers
+    pthread_cond_t not_full;
+    int rear;                 // Index of the next free slot
+} BlockingQueue;
+
 /* Function declarations */
 Queue* queue_create(int capacity);
+// Queue whose array starts at initial_capacity (rounded up to a power of two)
+// and doubles when full, up to max_capacity elements (0 = no limit). With
+// shrink set it halves again, down to the initial size, when a quarter full.
+Queue* queue_create_growable(size_t initial_capacity, size_t max_capacity, bool shrink);
 void queue_destroy(Queue *queue);
 bool queue_enqueue(Queue *queue, void *item);
 void* queue_dequeue(Queue *queue);
 void* queue_peek(Queue *queue);
 bool queue_is_empty(Queue *queue);
 bool queue_is_full(Queue *queue);
-int queue_size(Queue *queue);
+size_t queue_size(Queue *queue);
+
+BlockingQueue* blocking_queue_create(int capacity);
+// Only once no thread uses the queue any more
+void blocking_queue_destroy(BlockingQueue *queue);
+// Wait for room / an element. Timed variants give up after timeout_ms with
+// QUEUE_TIMEOUT (0 = try once, -1 = wait forever).
+int blocking_queue_enqueue(BlockingQueue *queue, void *item);
+int blocking_queue_dequeue(BlockingQueue *queue, void **item);
+int blocking_queue_enqueue_timed(BlockingQueue *queue, void *item, int timeout_ms);
+int blocking_queue_dequeue_timed(BlockingQueue *queue, void **item, int timeout_ms);
+// Wait up to timeout_ms for at least one element, then take up to max at
+// once. Returns the number taken, QUEUE_TIMEOUT or QUEUE_CLOSED.
+int blocking_queue_dequeue_many(BlockingQueue *queue, void **items, int max, int timeout_ms);
+// Refuse further enqueues and wake every waiter. Consumers still drain what
+// is queued before they see QUEUE_CLOSED.
+void blocking_queue_close(BlockingQueue *queue);
+bool blocking_queue_is_closed(BlockingQueue *queue);
+int blocking_queue_size(BlockingQueue *queue);
+
+// Queue of type values stored inline in the ring, no allocation per element.
+// QUEUE_DEFINE(name, type) defines the struct name and static inline
+// name_create / name_destroy / name_enqueue / name_emplace / name_dequeue /
+// name_front / name_pop / name_size / name_is_empty / name_is_full.
+// Elements move by memcpy, never by assignment. name_emplace and name_front
+// hand out the slot itself, so a payload can be built and consumed in place
+// without a copy. Pointers into the ring are valid until the next enqueue
+// or pop.
+#define QUEUE_DEFINE(name, type)                                                    \
+typedef struct name {                                                               \
+    type *items;       /* mask + 1 slots, a power of two */                         \
+    size_t front;      /* Index of the front element */                             \
+    size_t size;       /* Current number of elements */                             \
+    size_t mask;       /* Array length - 1 */                                       \
+    bool growable;     /* Double the array when full */                             \
+} name;                                                                             \
+                                                                                    \
+/* capacity is rounded up to a power of two */                                      \
+static inline name* name##_create(size_t capacity, bool growable)                   \
+{                                                                                   \
+    size_t slots = 1;                                                               \
+    while (slots < capacity) {                                                      \
+        if (slots > ((size_t)-1) / 2 / sizeof(type)) {                              \
+            return NULL;                                                            \
+        }                                                                           \
+        slots <<= 1;                                                                \
+    }                                                                               \
+    name *queue = (name*)malloc(sizeof(name));                                      \
+    if (queue == NULL) {                                                            \
+        return NULL;                                                                \
+    }                                                                               \
+    queue->items = (type*)malloc(sizeof(type) * slots);                             \
+    if (queue->items == NULL) {                                                     \
+        free(queue);                                                                \
+        return NULL;                                                                \
+    }                                                                               \
+    queue->front = 0;                                                               \
+    queue->size = 0;                                                                \
+    queue->mask = slots - 1;                                                        \
+    queue->growable = growable;                                                     \
+    return queue;                                                                   \
+}                                                                                   \
+                                                                                    \
+/* Elements still queued are dropped without any cleanup */                         \
+static inline void name##_destroy(name *queue)                                      \
+{                                                                                   \
+    if (queue != NULL) {                                                            \
+        free(queue->items);                                                         \
+        free(queue);                                                                \
+    }                                                                               \
+}                                                                                   \
+                                                                                    \
+static inline size_t name##_size(name *queue)                                       \
+{                                                                                   \
+    return queue->size;                                                             \
+}                                                                                   \
+                                                                                    \
+static inline bool name##_is_empty(name *queue)                                     \
+{                                                                                   \
+    return queue->size == 0;                                                        \
+}                                                                                   \
+                                                                                    \
+static inline bool name##_is_full(name *queue)                                      \
+{                                                                                   \
+    return !queue->growable && queue->size == queue->mask + 1;                      \
+}                                                                                   \
+                                                                                    \
+/* Reserve the rear slot for the caller to fill, NULL when full */                  \
+static inline type* name##_emplace(name *queue)                                     \
+{                                                                                   \
+    size_t slots = queue->mask + 1;                                                 \
+    if (queue->size == slots) {                                                     \
+        if (!queue->growable || slots > ((size_t)-1) / 2 / sizeof(type)) {          \
+            return NULL;                                                            \
+        }                                                                           \
+        /* Unwrap into the new array */                                             \
+        type *items = (type*)malloc(sizeof(type) * slots * 2);                      \
+        if (items == NULL) {                                                        \
+            return NULL;                                                            \
+        }                                                                           \
+        size_t first = slots - queue->front;                                        \
+        memcpy(items, queue->items + queue->front, sizeof(type) * first);           \
+        memcpy(items + first, queue->items, sizeof(type) * queue->front);           \
+        free(queue->items);                                                         \
+        queue->items = items;                                                       \
+        queue->front = 0;                                                           \
+        queue->mask = slots * 2 - 1;                                                \
+    }                                                                               \
+    type *slot = &queue->items[(queue->front + queue->size) & queue->mask];         \
+    queue->size++;                                                                  \
+    return slot;                                                                    \
+}                                                                                   \
+                                                                                    \
+static inline bool name##_enqueue(name *queue, const type *item)                    \
+{                                                                                   \
+    type *slot = name##_emplace(queue);                                             \
+    if (slot == NULL) {                                                             \
+        return false;                                                               \
+    }                                                                               \
+    memcpy(slot, item, sizeof(type));                                               \
+    return true;                                                                    \
+}                                                                                   \
+                                                                                    \
+/* Front element in place, NULL when empty */                                       \
+static inline type* name##_front(name *queue)                                       \
+{                                                                                   \
+    return queue->size > 0 ? &queue->items[queue->front] : NULL;                    \
+}                                                                                   \
+                                                                                    \
+/* Drop the front element, after it has been consumed through name_front */         \
+static inline void name##_pop(name *queue)                                          \
+{                                                                                   \
+    if (queue->size > 0) {                                                          \
+        queue->front = (queue->front + 1) & queue->mask;                            \
+        queue->size--;                                                              \
+    }                                                                               \
+}                                                                                   \
+                                                                                    \
+/* Move the front element to *item */                                               \
+static inline bool name##_dequeue(name *queue, type *item)                          \
+{                                                                                   \
+    if (queue->size == 0) {                                                         \
+        return false;                                                               \
+    }                                                                               \
+    memcpy(item, &queue->items[queue->front], sizeof(type));                        \
+    name##_pop(queue);                                                              \
+    return true;                                                                    \
+}
 
 #ifdef __cplusplus
 }
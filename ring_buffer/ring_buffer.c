@@ -1,22 +1,259 @@
+#define _GNU_SOURCE
 #include "ring_buffer.h"
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
+// 阻塞等待前的自旋次数
+#define RING_BUFFER_SPIN_COUNT 128
+
+
+// 以下辅助函数中的 limit 表示从 buffer 起始可连续访问的字节数:
+// 普通模式下等于容量, 镜像模式下数据区被映射了两次, 等于两倍容量, 拆分分支永远不会走到
+
+// 按环形方式写入, 处理跨越缓冲区末尾的情况
+static void ring_buffer_copy_in(char *buffer, size_t limit, size_t offset,
+                                const void *src, size_t len)
+{
+    size_t space_to_end = limit - offset;
+    if (len <= space_to_end) {
+        memcpy(buffer + offset, src, len);
+    } else {
+        memcpy(buffer + offset, src, space_to_end);
+        memcpy(buffer, (const char *)src + space_to_end, len - space_to_end);
+    }
+}
+
+// 按环形方式读出, 处理跨越缓冲区末尾的情况
+static void ring_buffer_copy_out(const char *buffer, size_t limit, size_t offset,
+                                 void *dst, size_t len)
+{
+    size_t space_to_end = limit - offset;
+    if (len <= space_to_end) {
+        memcpy(dst, buffer + offset, len);
+    } else {
+        memcpy(dst, buffer + offset, space_to_end);
+        memcpy((char *)dst + space_to_end, buffer, len - space_to_end);
+    }
+}
+
+// 把从 offset 开始、长度为 len 的区域拆成最多两个连续片段, 返回片段数
+static size_t ring_buffer_make_spans(char *buffer, size_t limit, size_t offset,
+                                     size_t len, ring_buffer_span span[2])
+{
+    size_t space_to_end = limit - offset;
+    span[0].data = buffer + offset;
+    if (len <= space_to_end) {
+        span[0].len = len;
+        span[1].data = NULL;
+        span[1].len = 0;
+        return 1;
+    }
+
+    span[0].len = space_to_end;
+    span[1].data = buffer;
+    span[1].len = len - space_to_end;
+    return 2;
+}
+
+// 变长记录头最多占用的字节数
+#define RING_BUFFER_VARINT_MAX ((sizeof(size_t) * 8 + 6) / 7)
+
+// 位置映射到数据区偏移, 容量总是2的幂, 用掩码代替取模
+static inline size_t ring_buffer_index(size_t mask, uint64_t pos)
+{
+    return (size_t)(pos & mask);
+}
+
+// 容量(2的幂)对应的掩码
+static inline size_t ring_buffer_mask(size_t capacity)
+{
+    return capacity - 1;
+}
+
+// 记录头长度: 默认固定为 sizeof(size_t), RING_BUFFER_VARINT 时为 LEB128 编码长度
+static inline size_t ring_buffer_header_size(unsigned int flags, size_t len)
+{
+    if (!(flags & RING_BUFFER_VARINT)) return sizeof(size_t);
+
+    size_t size = 1;
+    while (len >= 0x80) {
+        len >>= 7;
+        size++;
+    }
+    return size;
+}
+
+// 在 offset 处写入占用 width 字节的记录头
+// 变长编码时 width 可以大于最短编码长度, 多出的字节是带延续位的0, 解码结果不变
+static void ring_buffer_write_header(char *buffer, size_t limit, size_t offset,
+                                     unsigned int flags, size_t len, size_t width)
+{
+    if (!(flags & RING_BUFFER_VARINT)) {
+        ring_buffer_copy_in(buffer, limit, offset, &len, sizeof(size_t));
+        return;
+    }
+
+    uint8_t header[RING_BUFFER_VARINT_MAX];
+    for (size_t i = 0; i + 1 < width; i++) {
+        header[i] = (uint8_t)(len & 0x7f) | 0x80;
+        len >>= 7;
+    }
+    header[width - 1] = (uint8_t)len;
+    ring_buffer_copy_in(buffer, limit, offset, header, width);
+}
+
+// 读取 offset 处的记录头, 返回记录头占用的字节数, used 为队首之后已提交的字节数
+// 变长编码超过 RING_BUFFER_VARINT_MAX 字节仍未结束, 或记录头加记录长度超过 used,
+// 说明数据已损坏, 返回0
+static size_t ring_buffer_read_header(const char *buffer, size_t limit, size_t offset,
+                                      unsigned int flags, size_t used, size_t *len)
+{
+    if (!(flags & RING_BUFFER_VARINT)) {
+        if (used < sizeof(size_t)) return 0;
+        ring_buffer_copy_out(buffer, limit, offset, len, sizeof(size_t));
+        return *len > used - sizeof(size_t) ? 0 : sizeof(size_t);
+    }
+
+    // 逐字节解码, 不会读到记录头之后的字节, 移位量始终小于 size_t 的位数
+    size_t value = 0;
+    for (size_t i = 0; i < RING_BUFFER_VARINT_MAX && i < used; i++) {
+        size_t at = offset + i;
+        if (at >= limit) at -= limit;
+        uint8_t byte = (uint8_t)buffer[at];
+        value |= (size_t)(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            if (value > used - (i + 1)) return 0;
+            *len = value;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// 共享内存队列控制块中允许出现的标志, SHM 与 MIRRORED 总是置位
+#define RING_BUFFER_SHM_FLAGS (RING_BUFFER_MIRRORED | RING_BUFFER_VARINT | RING_BUFFER_SHM)
+
+// 容量向上取整到页大小
+static size_t ring_buffer_page_align(size_t size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+// 调整容量: 总是向上取整到2的幂, 位置到偏移的映射在热路径上只需一次掩码;
+// 镜像模式再按页对齐(页大小是2的幂, 结果仍是2的幂)。溢出时返回0
+static size_t ring_buffer_adjust_capacity(size_t capacity, unsigned int flags)
+{
+    if (capacity == 0) return 0;
+
+    size_t pow2 = 1;
+    while (pow2 < capacity) {
+        if (pow2 > ((size_t)-1) / 2) return 0;
+        pow2 <<= 1;
+    }
+    capacity = pow2;
+    if (flags & RING_BUFFER_MIRRORED) {
+        capacity = ring_buffer_page_align(capacity);
+    }
+    return capacity;
+}
+
+// 把 fd 的 [0, header_size + capacity) 映射到一段连续地址, 并紧接着把数据区再映射一次,
+// 使得 base + header_size 起的 2 * capacity 字节在环形意义上总是连续的
+// header_size 与 capacity 都必须是页大小的整数倍
+static void *ring_buffer_map_mirror(int fd, size_t header_size, size_t capacity)
+{
+    size_t total = header_size + 2 * capacity;
+
+    // 先占住整段虚拟地址, 再用 MAP_FIXED 覆盖
+    char *base = mmap(NULL, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+
+    if (mmap(base, header_size + capacity, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + header_size + capacity, capacity, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, (off_t)header_size) == MAP_FAILED) {
+        munmap(base, total);
+        return NULL;
+    }
+
+    return base;
+}
+
+// 创建匿名 memfd 并建立镜像映射, 失败返回NULL
+static void *ring_buffer_create_mirror(size_t header_size, size_t capacity)
+{
+    int fd = memfd_create("ring_buffer", MFD_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    void *base = NULL;
+    if (ftruncate(fd, (off_t)(header_size + capacity)) == 0) {
+        base = ring_buffer_map_mirror(fd, header_size, capacity);
+    }
+
+    // 映射建立后 fd 不再需要
+    close(fd);
+    return base;
+}
+
+// 位置映射到数据区偏移
+static inline size_t ring_buffer_offset(const ring_buffer *queue, uint64_t pos)
+{
+    return ring_buffer_index(queue->mask, pos);
+}
+
+// 可连续访问的字节数, 见辅助函数说明
+static inline size_t ring_buffer_limit(const ring_buffer *queue)
+{
+    return (queue->flags & RING_BUFFER_MIRRORED) ? 2 * queue->capacity : queue->capacity;
+}
 
 // 初始化队列
 ring_buffer* ring_buffer_create(size_t capacity)
 {
+    return ring_buffer_create_ex(capacity, 0);
+}
+
+// 初始化镜像队列, 容量向上取整到页大小
+ring_buffer* ring_buffer_create_mirrored(size_t capacity)
+{
+    return ring_buffer_create_ex(capacity, RING_BUFFER_MIRRORED);
+}
+
+// 按创建标志初始化队列
+ring_buffer* ring_buffer_create_ex(size_t capacity, unsigned int flags)
+{
+    capacity = ring_buffer_adjust_capacity(capacity, flags);
+    if (capacity == 0) return NULL;
+
     ring_buffer *queue = malloc(sizeof(ring_buffer));
     if (!queue) return NULL;
-    
-    queue->buffer = malloc(capacity);
+
+    if (flags & RING_BUFFER_MIRRORED) {
+        queue->buffer = ring_buffer_create_mirror(0, capacity);
+    } else {
+        queue->buffer = malloc(capacity);
+    }
     if (!queue->buffer) {
         free(queue);
         return NULL;
     }
-    
+
     queue->capacity = capacity;
+    queue->mask = ring_buffer_mask(capacity);
     queue->head = 0;
     queue->tail = 0;
-    queue->is_full = false;
+    queue->reserved = 0;
+    queue->dropped = 0;
+    queue->flags = flags;
     return queue;
 }
 
@@ -24,7 +261,11 @@ ring_buffer* ring_buffer_create(size_t capacity)
 void ring_buffer_destroy(ring_buffer *queue)
 {
     if (queue) {
-        free(queue->buffer);
+        if (queue->flags & RING_BUFFER_MIRRORED) {
+            munmap(queue->buffer, 2 * queue->capacity);
+        } else {
+            free(queue->buffer);
+        }
         free(queue);
     }
 }
@@ -32,101 +273,916 @@ void ring_buffer_destroy(ring_buffer *queue)
 // 检查队列是否为空
 bool ring_buffer_is_empty(const ring_buffer *queue)
 {
-    return (queue->head == queue->tail) && !queue->is_full;
+    return queue->head == queue->tail;
 }
 
 // 检查队列是否已满
 bool ring_buffer_is_full(const ring_buffer *queue)
 {
-    return queue->is_full;
+    return (size_t)(queue->tail - queue->head) == queue->capacity;
 }
 
 // 计算可用空间
 size_t ring_buffer_available(const ring_buffer *queue)
 {
-    if (queue->is_full) return 0;
-    
-    if (queue->head <= queue->tail) {
-        return queue->capacity - (queue->tail - queue->head);
-    } else {
-        return queue->head - queue->tail;
+    return queue->capacity - (size_t)(queue->tail - queue->head);
+}
+
+// 覆盖模式下从队首丢弃整条旧记录, 直到能放下 need 字节, 单条记录超过容量时返回false
+static bool ring_buffer_make_room(ring_buffer *queue, size_t need)
+{
+    if (!(queue->flags & RING_BUFFER_OVERWRITE) || need > queue->capacity) return false;
+
+    while (ring_buffer_available(queue) < need) {
+        if (!ring_buffer_dequeue(queue, NULL, NULL)) return false;
+        queue->dropped++;
     }
+    return true;
+}
+
+// 覆盖模式下累计丢弃的记录数
+uint64_t ring_buffer_dropped(const ring_buffer *queue)
+{
+    return queue->dropped;
 }
 
 // 入队操作
 bool ring_buffer_enqueue(ring_buffer *queue, const void *data, size_t data_len)
 {
     if (!queue || !data || data_len == 0) return false;
-    
-    // 检查是否有足够空间
-    if (data_len + sizeof(size_t) > ring_buffer_available(queue)) {
-        return false;
-    }
-    
-    // 先写入数据长度
-    size_t *len_ptr = (size_t *)((char *)queue->buffer + queue->tail);
-    *len_ptr = data_len;
-    queue->tail += sizeof(size_t);
-    if (queue->tail >= queue->capacity) {
-        queue->tail -= queue->capacity;
-    }
-    
-    // 写入实际数据
-    size_t space_to_end = queue->capacity - queue->tail;
-    if (data_len <= space_to_end) {
-        memcpy((char *)queue->buffer + queue->tail, data, data_len);
-        queue->tail += data_len;
-    } else {
-        memcpy((char *)queue->buffer + queue->tail, data, space_to_end);
-        memcpy(queue->buffer, (char *)data + space_to_end, data_len - space_to_end);
-        queue->tail = data_len - space_to_end;
-    }
-    
-    if (queue->tail == queue->head) {
-        queue->is_full = true;
+
+    ring_buffer_span span[2];
+    size_t count = ring_buffer_reserve(queue, data_len, span);
+    if (count == 0) return false;
+
+    // 写入实际数据, 数据长度在提交时写入
+    memcpy(span[0].data, data, span[0].len);
+    if (count == 2) {
+        memcpy(span[1].data, (const char *)data + span[0].len, span[1].len);
     }
-    
-    return true;
+
+    return ring_buffer_commit(queue, data_len);
 }
 
 // 出队操作
 bool ring_buffer_dequeue(ring_buffer *queue, void *data, size_t *data_len)
 {
     if (!queue || ring_buffer_is_empty(queue)) return false;
-    
-    // 读取数据长度
+
+    // 读取数据长度, 长度头本身也可能跨越缓冲区末尾
     size_t len;
-    size_t *len_ptr = (size_t *)((char *)queue->buffer + queue->head);
-    len = *len_ptr;
-    queue->head += sizeof(size_t);
-    if (queue->head >= queue->capacity) {
-        queue->head -= queue->capacity;
-    }
-    
+    size_t header = ring_buffer_read_header(queue->buffer, ring_buffer_limit(queue),
+                                            ring_buffer_offset(queue, queue->head), queue->flags,
+                                            (size_t)(queue->tail - queue->head), &len);
+    if (header == 0) return false;
+
     // 如果提供了data_len指针，返回数据长度
     if (data_len) {
         *data_len = len;
     }
-    
-    // 如果提供了data缓冲区，复制数据
+
+    // 如果提供了data缓冲区，复制数据; 否则只移动指针
     if (data) {
-        size_t space_to_end = queue->capacity - queue->head;
-        if (len <= space_to_end) {
-            memcpy(data, (char *)queue->buffer + queue->head, len);
-            queue->head += len;
+        ring_buffer_copy_out(queue->buffer, ring_buffer_limit(queue),
+                             ring_buffer_offset(queue, queue->head + header), data, len);
+    }
+    queue->head += header + len;
+    return true;
+}
+
+// 预留一条长度为 data_len 的记录, 通过 span 返回可直接写入的片段, 返回片段数(0表示空间不足)
+size_t ring_buffer_reserve(ring_buffer *queue, size_t data_len, ring_buffer_span span[2])
+{
+    if (!queue || !span || data_len == 0) return 0;
+
+    size_t header = ring_buffer_header_size(queue->flags, data_len);
+    if (data_len + header > ring_buffer_available(queue) &&
+        !ring_buffer_make_room(queue, data_len + header)) {
+        return 0;
+    }
+
+    queue->reserved = data_len;
+    size_t offset = ring_buffer_offset(queue, queue->tail + header);
+    return ring_buffer_make_spans(queue->buffer, ring_buffer_limit(queue), offset, data_len, span);
+}
+
+// 提交预留的记录, data_len 可以小于预留长度
+bool ring_buffer_commit(ring_buffer *queue, size_t data_len)
+{
+    if (!queue || data_len == 0 || data_len > queue->reserved) return false;
+
+    // 记录头按预留长度占位, 数据区位置与 reserve 返回的一致
+    size_t header = ring_buffer_header_size(queue->flags, queue->reserved);
+    ring_buffer_write_header(queue->buffer, ring_buffer_limit(queue),
+                             ring_buffer_offset(queue, queue->tail),
+                             queue->flags, data_len, header);
+    queue->tail += header + data_len;
+    queue->reserved = 0;
+    return true;
+}
+
+// 查看队首记录但不出队, 通过 span 返回可直接读取的片段, 返回片段数(0表示队列为空)
+size_t ring_buffer_peek(const ring_buffer *queue, ring_buffer_span span[2])
+{
+    if (!queue || !span || ring_buffer_is_empty(queue)) return 0;
+
+    size_t len;
+    size_t header = ring_buffer_read_header(queue->buffer, ring_buffer_limit(queue),
+                                            ring_buffer_offset(queue, queue->head), queue->flags,
+                                            (size_t)(queue->tail - queue->head), &len);
+    if (header == 0) return 0;
+    size_t offset = ring_buffer_offset(queue, queue->head + header);
+    return ring_buffer_make_spans(queue->buffer, ring_buffer_limit(queue), offset, len, span);
+}
+
+// 释放 peek 得到的队首记录
+bool ring_buffer_release(ring_buffer *queue)
+{
+    return ring_buffer_dequeue(queue, NULL, NULL);
+}
+
+// 批量入队, 按顺序写入尽可能多的记录, 最后只更新一次 tail, 返回写入的记录数
+size_t ring_buffer_enqueue_batch(ring_buffer *queue, const struct iovec *records, size_t count)
+{
+    if (!queue || !records) return 0;
+
+    size_t limit = ring_buffer_limit(queue);
+    size_t available = ring_buffer_available(queue);
+    uint64_t tail = queue->tail;
+    size_t n = 0;
+
+    for (; n < count; n++) {
+        size_t len = records[n].iov_len;
+        if (!records[n].iov_base || len == 0) break;
+
+        size_t header = ring_buffer_header_size(queue->flags, len);
+        if (len + header > available) {
+            // 覆盖模式下先提交已写入的记录, 它们也可能需要被丢弃
+            queue->tail = tail;
+            if (!ring_buffer_make_room(queue, len + header)) break;
+            available = ring_buffer_available(queue);
+        }
+
+        ring_buffer_write_header(queue->buffer, limit, ring_buffer_offset(queue, tail),
+                                 queue->flags, len, header);
+        ring_buffer_copy_in(queue->buffer, limit, ring_buffer_offset(queue, tail + header),
+                            records[n].iov_base, len);
+        tail += header + len;
+        available -= header + len;
+    }
+
+    queue->tail = tail;
+    return n;
+}
+
+// 批量出队, 最多取出 max_records 条记录, 依次紧凑地复制到 data(总长不超过 data_size),
+// records[i] 指向每条记录在 data 中的位置, 最后只更新一次 head, 返回取出的记录数
+// 队首记录长度超过 data_size 时返回0, 此时应改用 peek/release
+size_t ring_buffer_dequeue_batch(ring_buffer *queue, void *data, size_t data_size,
+                                 struct iovec *records, size_t max_records)
+{
+    if (!queue || !data || !records) return 0;
+
+    size_t limit = ring_buffer_limit(queue);
+    uint64_t head = queue->head;
+    size_t copied = 0;
+    size_t n = 0;
+
+    for (; n < max_records && head != queue->tail; n++) {
+        size_t len;
+        size_t header = ring_buffer_read_header(queue->buffer, limit, ring_buffer_offset(queue, head),
+                                                queue->flags, (size_t)(queue->tail - head), &len);
+        if (header == 0 || len > data_size - copied) break;
+
+        records[n].iov_base = (char *)data + copied;
+        records[n].iov_len = len;
+        ring_buffer_copy_out(queue->buffer, limit, ring_buffer_offset(queue, head + header),
+                             records[n].iov_base, len);
+
+        head += header + len;
+        copied += len;
+    }
+
+    queue->head = head;
+    return n;
+}
+
+static inline char *spsc_ring_buffer_data(const spsc_ring_buffer *queue)
+{
+    return queue->data;
+}
+
+static inline size_t spsc_ring_buffer_limit(const spsc_ring_buffer *queue)
+{
+    return (queue->flags & RING_BUFFER_MIRRORED) ? 2 * queue->capacity : queue->capacity;
+}
+
+static inline size_t spsc_ring_buffer_offset(const spsc_ring_buffer *queue, uint64_t pos)
+{
+    return ring_buffer_index(queue->mask, pos);
+}
+
+// 为控制块分配进程内句柄并记下布局, 之后的偏移与映射长度只从句柄计算
+static spsc_ring_buffer *spsc_ring_buffer_handle(spsc_ring_buffer_ctrl *ctrl, size_t header_size,
+                                                 size_t capacity, unsigned int flags)
+{
+    spsc_ring_buffer *queue = malloc(sizeof(spsc_ring_buffer));
+    if (!queue) return NULL;
+
+    queue->ctrl = ctrl;
+    queue->data = (char *)ctrl + header_size;
+    queue->capacity = capacity;
+    queue->mask = ring_buffer_mask(capacity);
+    queue->map_size = (flags & RING_BUFFER_MIRRORED) ? header_size + 2 * capacity : 0;
+    queue->flags = flags;
+    return queue;
+}
+
+// 初始化SPSC队列
+spsc_ring_buffer* spsc_ring_buffer_create(size_t capacity)
+{
+    return spsc_ring_buffer_create_ex(capacity, 0);
+}
+
+// 初始化镜像SPSC队列, 容量向上取整到页大小
+spsc_ring_buffer* spsc_ring_buffer_create_mirrored(size_t capacity)
+{
+    return spsc_ring_buffer_create_ex(capacity, RING_BUFFER_MIRRORED);
+}
+
+// 按创建标志初始化SPSC队列
+spsc_ring_buffer* spsc_ring_buffer_create_ex(size_t capacity, unsigned int flags)
+{
+    capacity = ring_buffer_adjust_capacity(capacity, flags);
+    if (capacity == 0) return NULL;
+
+    void *mem = NULL;
+    size_t header_size = sizeof(spsc_ring_buffer_ctrl);
+    if (flags & RING_BUFFER_MIRRORED) {
+        // 镜像映射要求数据区从页边界开始
+        header_size = ring_buffer_page_align(header_size);
+        mem = ring_buffer_create_mirror(header_size, capacity);
+        if (!mem) return NULL;
+    } else if (posix_memalign(&mem, RING_BUFFER_CACHE_LINE, header_size + capacity) != 0) {
+        return NULL;
+    }
+
+    spsc_ring_buffer_ctrl *ctrl = mem;
+    memset(ctrl, 0, sizeof(spsc_ring_buffer_ctrl));
+    ctrl->capacity = capacity;
+    ctrl->mask = ring_buffer_mask(capacity);
+    ctrl->data_offset = header_size;
+    ctrl->flags = flags;
+
+    spsc_ring_buffer *queue = spsc_ring_buffer_handle(ctrl, header_size, capacity, flags);
+    if (!queue) {
+        if (flags & RING_BUFFER_MIRRORED) {
+            munmap(mem, header_size + 2 * capacity);
         } else {
-            memcpy(data, (char *)queue->buffer + queue->head, space_to_end);
-            memcpy((char *)data + space_to_end, queue->buffer, len - space_to_end);
-            queue->head = len - space_to_end;
+            free(mem);
+        }
+    }
+    return queue;
+}
+
+// 在 fd 上建立镜像映射并初始化控制块, 控制块占用第一页, 魔数最后写入
+static spsc_ring_buffer *spsc_ring_buffer_init_shm(int fd, size_t capacity, unsigned int flags)
+{
+    size_t header_size = ring_buffer_page_align(sizeof(spsc_ring_buffer_ctrl));
+    if (ftruncate(fd, (off_t)(header_size + capacity)) != 0) return NULL;
+
+    spsc_ring_buffer_ctrl *ctrl = ring_buffer_map_mirror(fd, header_size, capacity);
+    if (!ctrl) return NULL;
+
+    spsc_ring_buffer *queue = spsc_ring_buffer_handle(ctrl, header_size, capacity, flags);
+    if (!queue) {
+        munmap(ctrl, header_size + 2 * capacity);
+        return NULL;
+    }
+
+    memset(ctrl, 0, sizeof(spsc_ring_buffer_ctrl));
+    ctrl->version = RING_BUFFER_SHM_VERSION;
+    ctrl->capacity = capacity;
+    ctrl->mask = ring_buffer_mask(capacity);
+    ctrl->data_offset = header_size;
+    ctrl->flags = flags;
+
+    // 打开方看到魔数时, 控制块的其余字段都已初始化
+    __atomic_store_n(&ctrl->magic, RING_BUFFER_SHM_MAGIC, __ATOMIC_RELEASE);
+    return queue;
+}
+
+// 创建命名共享内存SPSC队列, 用于同一主机上的进程间通信
+// name 的格式同 shm_open(如 "/my_ring"), 已存在时失败; 容量向上取整到2的幂并按页对齐, 总是使用镜像映射
+spsc_ring_buffer* spsc_ring_buffer_create_shm(const char *name, size_t capacity, unsigned int flags)
+{
+    if (!name) return NULL;
+
+    flags = (flags & RING_BUFFER_SHM_FLAGS) | RING_BUFFER_SHM | RING_BUFFER_MIRRORED;
+    capacity = ring_buffer_adjust_capacity(capacity, flags);
+    if (capacity == 0) return NULL;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) return NULL;
+
+    spsc_ring_buffer *queue = spsc_ring_buffer_init_shm(fd, capacity, flags);
+    close(fd);
+    if (!queue) {
+        shm_unlink(name);
+    }
+    return queue;
+}
+
+// 打开已由 spsc_ring_buffer_create_shm 创建的共享内存SPSC队列
+// 控制块来自另一个进程, 不可信: 魔数或版本不匹配、标志不是 create_shm 写入的组合、
+// 容量不是按页对齐的2的幂、掩码与容量不符、文件大小与控制块描述不一致时都返回NULL
+spsc_ring_buffer* spsc_ring_buffer_open_shm(const char *name)
+{
+    if (!name) return NULL;
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) return NULL;
+
+    spsc_ring_buffer *queue = NULL;
+    size_t header_size = ring_buffer_page_align(sizeof(spsc_ring_buffer_ctrl));
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < header_size) {
+        close(fd);
+        return NULL;
+    }
+
+    // 先只映射控制块, 读出布局后再建立完整的镜像映射
+    spsc_ring_buffer_ctrl *header = mmap(NULL, header_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (header != MAP_FAILED) {
+        // 先拷出字段再校验, 避免对方在校验过程中改写
+        bool valid = __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == RING_BUFFER_SHM_MAGIC;
+        size_t capacity = header->capacity;
+        size_t mask = header->mask;
+        size_t data_offset = header->data_offset;
+        unsigned int flags = header->flags;
+        valid = valid && header->version == RING_BUFFER_SHM_VERSION;
+        munmap(header, header_size);
+
+        unsigned int required = RING_BUFFER_SHM | RING_BUFFER_MIRRORED;
+        valid = valid &&
+                (flags & required) == required && (flags & ~RING_BUFFER_SHM_FLAGS) == 0 &&
+                capacity != 0 && (capacity & (capacity - 1)) == 0 &&
+                ring_buffer_page_align(capacity) == capacity &&
+                mask == ring_buffer_mask(capacity) &&
+                data_offset == header_size &&
+                data_offset + capacity == (size_t)st.st_size;
+
+        // 之后只使用这里校验过的布局, 不再读取控制块中的布局字段
+        spsc_ring_buffer_ctrl *ctrl = valid ? ring_buffer_map_mirror(fd, header_size, capacity) : NULL;
+        if (ctrl) {
+            queue = spsc_ring_buffer_handle(ctrl, header_size, capacity, flags);
+            if (!queue) {
+                munmap(ctrl, header_size + 2 * capacity);
+            }
         }
+    }
+
+    close(fd);
+    return queue;
+}
+
+// 删除共享内存队列的名字, 已打开的映射在全部释放前仍然有效
+bool spsc_ring_buffer_unlink_shm(const char *name)
+{
+    return name && shm_unlink(name) == 0;
+}
+
+// 释放SPSC队列
+void spsc_ring_buffer_destroy(spsc_ring_buffer *queue)
+{
+    if (!queue) return;
+
+    // 共享内存队列总是镜像映射, 只解除本进程的映射, 长度来自句柄而不是共享的控制块
+    if (queue->map_size) {
+        munmap(queue->ctrl, queue->map_size);
     } else {
-        // 不复制数据，只移动指针
-        queue->head += len;
-        if (queue->head >= queue->capacity) {
-            queue->head -= queue->capacity;
+        free(queue->ctrl);
+    }
+    free(queue);
+}
+
+// 检查队列是否为空(另一端并发修改时结果仅供参考)
+bool spsc_ring_buffer_is_empty(const spsc_ring_buffer *queue)
+{
+    return __atomic_load_n(&queue->ctrl->head, __ATOMIC_ACQUIRE) ==
+           __atomic_load_n(&queue->ctrl->tail, __ATOMIC_ACQUIRE);
+}
+
+// 计算可用空间(另一端并发修改时结果仅供参考)
+size_t spsc_ring_buffer_available(const spsc_ring_buffer *queue)
+{
+    uint64_t head = __atomic_load_n(&queue->ctrl->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&queue->ctrl->tail, __ATOMIC_ACQUIRE);
+    return queue->capacity - (size_t)(tail - head);
+}
+
+// 生产者侧空间检查: 先用缓存的读位置判断, 空间不足时才去读消费者的缓存行
+static bool spsc_ring_buffer_has_space(spsc_ring_buffer *queue, size_t need)
+{
+    if (need > queue->capacity) return false;
+
+    uint64_t tail = queue->ctrl->tail;
+    if (need > queue->capacity - (size_t)(tail - queue->ctrl->cached_head)) {
+        queue->ctrl->cached_head = __atomic_load_n(&queue->ctrl->head, __ATOMIC_ACQUIRE);
+        if (need > queue->capacity - (size_t)(tail - queue->ctrl->cached_head)) {
+            return false;
         }
     }
-    
-    queue->is_full = false;
+    return true;
+}
+
+// 消费者侧数据检查: 先用缓存的写位置判断, 看起来为空时才去读生产者的缓存行
+static bool spsc_ring_buffer_has_data(spsc_ring_buffer *queue)
+{
+    uint64_t head = queue->ctrl->head;
+    if (head == queue->ctrl->cached_tail) {
+        queue->ctrl->cached_tail = __atomic_load_n(&queue->ctrl->tail, __ATOMIC_ACQUIRE);
+        if (head == queue->ctrl->cached_tail) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 消费者侧 head 之后已提交的字节数, 写位置来自另一端, 超过容量时视为损坏返回0
+static inline size_t spsc_ring_buffer_used(const spsc_ring_buffer *queue, uint64_t head)
+{
+    uint64_t used = queue->ctrl->cached_tail - head;
+    return used > queue->capacity ? 0 : (size_t)used;
+}
+
+static inline void ring_buffer_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static long ring_buffer_futex(uint32_t *addr, int op, uint32_t value, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, op, value, timeout, NULL, 0);
+}
+
+// 共享内存队列的等待者可能在其他进程中, 不能使用进程私有的 futex
+static inline int spsc_ring_buffer_futex_op(const spsc_ring_buffer *queue, int op)
+{
+    return (queue->flags & RING_BUFFER_SHM) ? op : (op | FUTEX_PRIVATE_FLAG);
+}
+
+// 发布新位置后, 只有存在等待者时才递增 futex 字并唤醒, 无等待者时不进入内核
+static void spsc_ring_buffer_notify(spsc_ring_buffer *queue, uint32_t *seq, uint32_t *waiters)
+{
+    // 与等待方登记 waiters 后的栅栏配对, 保证双方至少有一方能看到对方的写入
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_RELAXED) != 0) {
+        __atomic_add_fetch(seq, 1, __ATOMIC_RELEASE);
+        ring_buffer_futex(seq, spsc_ring_buffer_futex_op(queue, FUTEX_WAKE), INT_MAX, NULL);
+    }
+}
+
+// 生产者发布写位置并唤醒等待数据的消费者
+static inline void spsc_ring_buffer_publish_tail(spsc_ring_buffer *queue, uint64_t tail)
+{
+    __atomic_store_n(&queue->ctrl->tail, tail, __ATOMIC_RELEASE);
+    spsc_ring_buffer_notify(queue, &queue->ctrl->data_seq, &queue->ctrl->data_waiters);
+}
+
+// 消费者归还读位置并唤醒等待空间的生产者
+static inline void spsc_ring_buffer_publish_head(spsc_ring_buffer *queue, uint64_t head)
+{
+    __atomic_store_n(&queue->ctrl->head, head, __ATOMIC_RELEASE);
+    spsc_ring_buffer_notify(queue, &queue->ctrl->space_seq, &queue->ctrl->space_waiters);
+}
+
+// 登记为等待者, 返回当前 futex 字的值; 登记后必须再检查一次条件
+static uint32_t spsc_ring_buffer_wait_begin(uint32_t *seq, uint32_t *waiters)
+{
+    __atomic_add_fetch(waiters, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+}
+
+static void spsc_ring_buffer_wait_end(uint32_t *waiters)
+{
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_RELAXED);
+}
+
+// 计算截止时间, timeout_ms < 0 表示永久等待
+static void ring_buffer_deadline(struct timespec *deadline, int timeout_ms)
+{
+    if (timeout_ms < 0) return;
+
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// 在 futex 字上挂起直到其值不再等于 value 或超时, 超时返回false
+static bool spsc_ring_buffer_park(const spsc_ring_buffer *queue, uint32_t *seq, uint32_t value,
+                                  const struct timespec *deadline, int timeout_ms)
+{
+    int op = spsc_ring_buffer_futex_op(queue, FUTEX_WAIT);
+    if (timeout_ms < 0) {
+        ring_buffer_futex(seq, op, value, NULL);
+        return true;
+    }
+
+    struct timespec now, remain;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    remain.tv_sec = deadline->tv_sec - now.tv_sec;
+    remain.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (remain.tv_nsec < 0) {
+        remain.tv_sec -= 1;
+        remain.tv_nsec += 1000000000L;
+    }
+    if (remain.tv_sec < 0) return false;
+
+    if (ring_buffer_futex(seq, op, value, &remain) != 0 && errno == ETIMEDOUT) {
+        return false;
+    }
+    return true;
+}
+
+// 入队操作, 只能由生产者线程调用
+bool spsc_ring_buffer_enqueue(spsc_ring_buffer *queue, const void *data, size_t data_len)
+{
+    if (!queue || !data || data_len == 0) return false;
+
+    size_t header = ring_buffer_header_size(queue->flags, data_len);
+    size_t need = header + data_len;
+    if (!spsc_ring_buffer_has_space(queue, need)) return false;
+
+    uint64_t tail = queue->ctrl->tail;
+    char *buffer = spsc_ring_buffer_data(queue);
+    size_t limit = spsc_ring_buffer_limit(queue);
+    ring_buffer_write_header(buffer, limit, spsc_ring_buffer_offset(queue, tail),
+                             queue->flags, data_len, header);
+    ring_buffer_copy_in(buffer, limit, spsc_ring_buffer_offset(queue, tail + header),
+                        data, data_len);
+
+    // 数据写完后再发布写位置
+    spsc_ring_buffer_publish_tail(queue, tail + need);
+    return true;
+}
+
+// 出队操作, 只能由消费者线程调用
+bool spsc_ring_buffer_dequeue(spsc_ring_buffer *queue, void *data, size_t *data_len)
+{
+    if (!queue || !spsc_ring_buffer_has_data(queue)) return false;
+
+    // 读取数据长度
+    uint64_t head = queue->ctrl->head;
+    const char *buffer = spsc_ring_buffer_data(queue);
+    size_t limit = spsc_ring_buffer_limit(queue);
+    size_t len;
+    size_t header = ring_buffer_read_header(buffer, limit, spsc_ring_buffer_offset(queue, head),
+                                            queue->flags, spsc_ring_buffer_used(queue, head), &len);
+    if (header == 0) return false;
+
+    if (data_len) {
+        *data_len = len;
+    }
+
+    if (data) {
+        ring_buffer_copy_out(buffer, limit, spsc_ring_buffer_offset(queue, head + header),
+                             data, len);
+    }
+
+    // 数据读完后再归还空间
+    spsc_ring_buffer_publish_head(queue, head + header + len);
+    return true;
+}
+
+// 预留一条记录, 只能由生产者线程调用, 返回片段数(0表示空间不足)
+size_t spsc_ring_buffer_reserve(spsc_ring_buffer *queue, size_t data_len, ring_buffer_span span[2])
+{
+    if (!queue || !span || data_len == 0) return 0;
+    size_t header = ring_buffer_header_size(queue->flags, data_len);
+    if (!spsc_ring_buffer_has_space(queue, header + data_len)) return 0;
+
+    queue->ctrl->reserved = data_len;
+    size_t offset = spsc_ring_buffer_offset(queue, queue->ctrl->tail + header);
+    return ring_buffer_make_spans(spsc_ring_buffer_data(queue), spsc_ring_buffer_limit(queue),
+                                  offset, data_len, span);
+}
+
+// 提交预留的记录并发布给消费者, data_len 可以小于预留长度
+bool spsc_ring_buffer_commit(spsc_ring_buffer *queue, size_t data_len)
+{
+    if (!queue || data_len == 0 || data_len > queue->ctrl->reserved) return false;
+
+    // 记录头按预留长度占位, 数据区位置与 reserve 返回的一致
+    uint64_t tail = queue->ctrl->tail;
+    size_t header = ring_buffer_header_size(queue->flags, queue->ctrl->reserved);
+    ring_buffer_write_header(spsc_ring_buffer_data(queue), spsc_ring_buffer_limit(queue),
+                             spsc_ring_buffer_offset(queue, tail), queue->flags, data_len, header);
+    queue->ctrl->reserved = 0;
+
+    spsc_ring_buffer_publish_tail(queue, tail + header + data_len);
+    return true;
+}
+
+// 查看队首记录但不出队, 只能由消费者线程调用, 返回片段数(0表示队列为空)
+size_t spsc_ring_buffer_peek(spsc_ring_buffer *queue, ring_buffer_span span[2])
+{
+    if (!queue || !span || !spsc_ring_buffer_has_data(queue)) return 0;
+
+    uint64_t head = queue->ctrl->head;
+    char *buffer = spsc_ring_buffer_data(queue);
+    size_t len;
+    size_t header = ring_buffer_read_header(buffer, spsc_ring_buffer_limit(queue),
+                                            spsc_ring_buffer_offset(queue, head), queue->flags,
+                                            spsc_ring_buffer_used(queue, head), &len);
+    if (header == 0) return 0;
+    size_t offset = spsc_ring_buffer_offset(queue, head + header);
+    return ring_buffer_make_spans(buffer, spsc_ring_buffer_limit(queue), offset, len, span);
+}
+
+// 释放 peek 得到的队首记录, 把空间归还给生产者
+bool spsc_ring_buffer_release(spsc_ring_buffer *queue)
+{
+    return spsc_ring_buffer_dequeue(queue, NULL, NULL);
+}
+
+// 入队操作, 空间不足时先自旋, 然后挂起等待消费者归还空间
+// timeout_ms < 0 表示永久等待, 超时返回false; 记录长度超过容量时立即返回false
+bool spsc_ring_buffer_enqueue_wait(spsc_ring_buffer *queue, const void *data, size_t data_len,
+                                   int timeout_ms)
+{
+    if (!queue || !data || data_len == 0) return false;
+
+    size_t need = ring_buffer_header_size(queue->flags, data_len) + data_len;
+    if (need > queue->capacity) return false;
+
+    struct timespec deadline;
+    ring_buffer_deadline(&deadline, timeout_ms);
+
+    for (;;) {
+        for (int i = 0; i < RING_BUFFER_SPIN_COUNT; i++) {
+            if (spsc_ring_buffer_enqueue(queue, data, data_len)) return true;
+            ring_buffer_cpu_relax();
+        }
+
+        uint32_t value = spsc_ring_buffer_wait_begin(&queue->ctrl->space_seq, &queue->ctrl->space_waiters);
+        bool ok = spsc_ring_buffer_has_space(queue, need) ||
+                  spsc_ring_buffer_park(queue, &queue->ctrl->space_seq, value, &deadline, timeout_ms);
+        spsc_ring_buffer_wait_end(&queue->ctrl->space_waiters);
+
+        if (!ok) {
+            return spsc_ring_buffer_enqueue(queue, data, data_len);
+        }
+    }
+}
+
+// 出队操作, 队列为空时先自旋, 然后挂起等待生产者发布数据
+// timeout_ms < 0 表示永久等待, 超时返回false
+bool spsc_ring_buffer_dequeue_wait(spsc_ring_buffer *queue, void *data, size_t *data_len,
+                                   int timeout_ms)
+{
+    if (!queue) return false;
+
+    struct timespec deadline;
+    ring_buffer_deadline(&deadline, timeout_ms);
+
+    for (;;) {
+        for (int i = 0; i < RING_BUFFER_SPIN_COUNT; i++) {
+            if (spsc_ring_buffer_dequeue(queue, data, data_len)) return true;
+            ring_buffer_cpu_relax();
+        }
+
+        uint32_t value = spsc_ring_buffer_wait_begin(&queue->ctrl->data_seq, &queue->ctrl->data_waiters);
+        bool ok = spsc_ring_buffer_has_data(queue) ||
+                  spsc_ring_buffer_park(queue, &queue->ctrl->data_seq, value, &deadline, timeout_ms);
+        spsc_ring_buffer_wait_end(&queue->ctrl->data_waiters);
+
+        // 超时后最后再试一次; 有数据时出队仍失败说明记录头已损坏, 不再等待
+        if (!ok || spsc_ring_buffer_has_data(queue)) {
+            return spsc_ring_buffer_dequeue(queue, data, data_len);
+        }
+    }
+}
+
+// 批量入队, 只能由生产者线程调用, 所有记录写完后只发布一次 tail, 返回写入的记录数
+size_t spsc_ring_buffer_enqueue_batch(spsc_ring_buffer *queue, const struct iovec *records,
+                                      size_t count)
+{
+    if (!queue || !records) return 0;
+
+    char *buffer = spsc_ring_buffer_data(queue);
+    size_t limit = spsc_ring_buffer_limit(queue);
+    uint64_t start = queue->ctrl->tail;
+    uint64_t tail = start;
+    size_t n = 0;
+
+    for (; n < count; n++) {
+        size_t len = records[n].iov_len;
+        if (!records[n].iov_base || len == 0) break;
+
+        // 空间检查基于尚未发布的本地 tail
+        size_t header = ring_buffer_header_size(queue->flags, len);
+        size_t need = header + len;
+        if (need > queue->capacity) break;
+        if (need > queue->capacity - (size_t)(tail - queue->ctrl->cached_head)) {
+            queue->ctrl->cached_head = __atomic_load_n(&queue->ctrl->head, __ATOMIC_ACQUIRE);
+            if (need > queue->capacity - (size_t)(tail - queue->ctrl->cached_head)) break;
+        }
+
+        ring_buffer_write_header(buffer, limit, spsc_ring_buffer_offset(queue, tail),
+                                 queue->flags, len, header);
+        ring_buffer_copy_in(buffer, limit, spsc_ring_buffer_offset(queue, tail + header),
+                            records[n].iov_base, len);
+        tail += need;
+    }
+
+    if (tail != start) {
+        spsc_ring_buffer_publish_tail(queue, tail);
+    }
+    return n;
+}
+
+// 批量出队, 只能由消费者线程调用, 语义同 ring_buffer_dequeue_batch, 最后只归还一次 head
+size_t spsc_ring_buffer_dequeue_batch(spsc_ring_buffer *queue, void *data, size_t data_size,
+                                      struct iovec *records, size_t max_records)
+{
+    if (!queue || !data || !records) return 0;
+
+    const char *buffer = spsc_ring_buffer_data(queue);
+    size_t limit = spsc_ring_buffer_limit(queue);
+    uint64_t start = queue->ctrl->head;
+    uint64_t head = start;
+    size_t copied = 0;
+    size_t n = 0;
+
+    for (; n < max_records; n++) {
+        if (head == queue->ctrl->cached_tail) {
+            queue->ctrl->cached_tail = __atomic_load_n(&queue->ctrl->tail, __ATOMIC_ACQUIRE);
+            if (head == queue->ctrl->cached_tail) break;
+        }
+
+        size_t len;
+        size_t header = ring_buffer_read_header(buffer, limit, spsc_ring_buffer_offset(queue, head),
+                                                queue->flags, spsc_ring_buffer_used(queue, head), &len);
+        if (header == 0 || len > data_size - copied) break;
+
+        records[n].iov_base = (char *)data + copied;
+        records[n].iov_len = len;
+        ring_buffer_copy_out(buffer, limit, spsc_ring_buffer_offset(queue, head + header),
+                             records[n].iov_base, len);
+
+        head += header + len;
+        copied += len;
+    }
+
+    if (head != start) {
+        spsc_ring_buffer_publish_head(queue, head);
+    }
+    return n;
+}
+
+// MPMC 槽位头, 后面紧跟记录数据
+typedef struct {
+    uint64_t seq;           // 槽位序号: 等于位置时可写, 等于位置+1时可读
+    size_t len;             // 记录长度
+} mpmc_ring_buffer_slot;
+
+static inline mpmc_ring_buffer_slot *mpmc_ring_buffer_slot_at(const mpmc_ring_buffer *queue,
+                                                              uint64_t pos)
+{
+    return (mpmc_ring_buffer_slot *)(queue->slots + (pos & queue->mask) * queue->slot_size);
+}
+
+// 初始化MPMC队列, capacity 为槽位数(向上取整到2的幂), record_size 为单条记录最大长度
+mpmc_ring_buffer* mpmc_ring_buffer_create(size_t capacity, size_t record_size)
+{
+    if (capacity == 0 || record_size == 0) return NULL;
+
+    // 槽位按8字节对齐, 保证序号可以原子访问; 槽位数、槽位大小和总长度溢出时返回NULL
+    size_t align = sizeof(uint64_t);
+    if (record_size > ((size_t)-1) - sizeof(mpmc_ring_buffer_slot) - (align - 1)) return NULL;
+    size_t slot_size = (sizeof(mpmc_ring_buffer_slot) + record_size + align - 1) / align * align;
+
+    size_t slots = 1;
+    while (slots < capacity) {
+        if (slots > ((size_t)-1) / 2) return NULL;
+        slots <<= 1;
+    }
+    if (slots > ((size_t)-1) / slot_size) return NULL;
+
+    void *mem = NULL;
+    if (posix_memalign(&mem, RING_BUFFER_CACHE_LINE, sizeof(mpmc_ring_buffer)) != 0) {
+        return NULL;
+    }
+    mpmc_ring_buffer *queue = mem;
+    memset(queue, 0, sizeof(mpmc_ring_buffer));
+
+    queue->slot_size = slot_size;
+    queue->capacity = slots;
+    queue->mask = slots - 1;
+    queue->record_size = record_size;
+
+    if (posix_memalign(&mem, RING_BUFFER_CACHE_LINE, slots * queue->slot_size) != 0) {
+        free(queue);
+        return NULL;
+    }
+    queue->slots = mem;
+
+    for (size_t i = 0; i < slots; i++) {
+        mpmc_ring_buffer_slot_at(queue, i)->seq = i;
+    }
+
+    return queue;
+}
+
+// 释放MPMC队列
+void mpmc_ring_buffer_destroy(mpmc_ring_buffer *queue)
+{
+    if (queue) {
+        free(queue->slots);
+        free(queue);
+    }
+}
+
+// 检查队列是否为空(并发修改时结果仅供参考)
+bool mpmc_ring_buffer_is_empty(const mpmc_ring_buffer *queue)
+{
+    return __atomic_load_n(&queue->dequeue_pos, __ATOMIC_ACQUIRE) >=
+           __atomic_load_n(&queue->enqueue_pos, __ATOMIC_ACQUIRE);
+}
+
+// 入队操作, 可由任意线程调用, data_len 不能超过 record_size
+bool mpmc_ring_buffer_enqueue(mpmc_ring_buffer *queue, const void *data, size_t data_len)
+{
+    if (!queue || !data || data_len == 0 || data_len > queue->record_size) return false;
+
+    mpmc_ring_buffer_slot *slot;
+    uint64_t pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = mpmc_ring_buffer_slot_at(queue, pos);
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            // 槽位空闲, 抢占该位置; 失败时 pos 被更新为最新值
+            if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // 槽位还未被消费, 队列已满
+            return false;
+        } else {
+            pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->len = data_len;
+    memcpy(slot + 1, data, data_len);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// 出队操作, 可由任意线程调用, data 至少要有 record_size 字节
+bool mpmc_ring_buffer_dequeue(mpmc_ring_buffer *queue, void *data, size_t *data_len)
+{
+    if (!queue) return false;
+
+    mpmc_ring_buffer_slot *slot;
+    uint64_t pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = mpmc_ring_buffer_slot_at(queue, pos);
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // 槽位还未被写入, 队列为空
+            return false;
+        } else {
+            pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (data_len) {
+        *data_len = slot->len;
+    }
+    if (data) {
+        memcpy(data, slot + 1, slot->len);
+    }
+
+    // 把槽位交还给下一轮的生产者
+    __atomic_store_n(&slot->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
     return true;
 }
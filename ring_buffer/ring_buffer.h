@@ -6,23 +6,152 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/uio.h>
+
+// 缓存行大小, 用于隔离生产者/消费者各自写入的字段
+#define RING_BUFFER_CACHE_LINE 64
+
+// 容量总是向上取整到2的幂(镜像模式再按页对齐), 位置到偏移的映射只需一次掩码;
+// 实际容量以 capacity 字段和 available 为准, 最多是请求值的两倍, 例如请求100字节得到128字节
+
+// 创建标志
+#define RING_BUFFER_MIRRORED  0x1   // 数据区在虚拟地址上映射两次, 任意记录都是连续的(容量按页对齐)
+#define RING_BUFFER_VARINT    0x4   // 记录长度头用 LEB128 变长编码(小于128字节的记录只占1字节)
+#define RING_BUFFER_SHM       0x8   // 位于命名共享内存中(由 spsc_ring_buffer_create_shm 设置)
+#define RING_BUFFER_OVERWRITE 0x10  // 空间不足时丢弃最旧的整条记录, 入队永不因满而失败(仅 ring_buffer)
+
+// 共享内存队列的布局标识, 控制块字段或记录格式不兼容地改变时递增版本号
+#define RING_BUFFER_SHM_MAGIC   0x52425546u     // "RBUF"
+#define RING_BUFFER_SHM_VERSION 1u
 
 typedef struct {
     void *buffer;       // 队列存储区
     size_t capacity;    // 队列总容量(字节)
-    size_t head;        // 头部位置(字节偏移)
-    size_t tail;        // 尾部位置(字节偏移)
-    bool is_full;       // 队列是否已满标志
+    size_t mask;        // capacity - 1, 容量总是2的幂
+    uint64_t head;      // 头部位置(单调递增的字节位置)
+    uint64_t tail;      // 尾部位置(单调递增的字节位置), tail - head 即已用字节数
+    size_t reserved;    // 已预留但未提交的记录长度
+    uint64_t dropped;   // 覆盖模式下被丢弃的记录数
+    unsigned int flags; // 创建标志
 } ring_buffer;
 
+// 零拷贝接口返回的连续内存片段, 记录跨越缓冲区末尾时会拆成两段
+typedef struct {
+    void *data;         // 片段起始地址
+    size_t len;         // 片段长度(字节)
+} ring_buffer_span;
+
 ring_buffer* ring_buffer_create(size_t capacity);
+ring_buffer* ring_buffer_create_mirrored(size_t capacity);
+ring_buffer* ring_buffer_create_ex(size_t capacity, unsigned int flags);
 void ring_buffer_destroy(ring_buffer *queue);
 bool ring_buffer_is_empty(const ring_buffer *queue);
 bool ring_buffer_is_full(const ring_buffer *queue);
 size_t ring_buffer_available(const ring_buffer *queue);
+uint64_t ring_buffer_dropped(const ring_buffer *queue);
 bool ring_buffer_enqueue(ring_buffer *queue, const void *data, size_t data_len);
 bool ring_buffer_dequeue(ring_buffer *queue, void *data, size_t *data_len);
+size_t ring_buffer_reserve(ring_buffer *queue, size_t data_len, ring_buffer_span span[2]);
+bool ring_buffer_commit(ring_buffer *queue, size_t data_len);
+size_t ring_buffer_peek(const ring_buffer *queue, ring_buffer_span span[2]);
+bool ring_buffer_release(ring_buffer *queue);
+size_t ring_buffer_enqueue_batch(ring_buffer *queue, const struct iovec *records, size_t count);
+size_t ring_buffer_dequeue_batch(ring_buffer *queue, void *data, size_t data_size,
+                                 struct iovec *records, size_t max_records);
+
+// 单生产者/单消费者无锁环形缓冲区的控制块
+// 控制块与数据区在同一块内存中, 数据区位于控制块起始地址 + data_offset 处
+// head/tail 为单调递增的字节位置, 通过 acquire/release 发布, 不需要 is_full 标志
+// 控制块中不含指针, 可以整体放进共享内存被多个进程映射到不同地址
+typedef struct {
+    uint32_t magic;         // 共享内存队列为 RING_BUFFER_SHM_MAGIC, 否则为0
+    uint32_t version;       // 共享内存布局版本
+    size_t capacity;        // 数据区总容量(字节)
+    size_t mask;            // capacity - 1, 容量总是2的幂
+    size_t data_offset;     // 数据区相对控制块的偏移
+    unsigned int flags;     // 创建标志
+    char pad0[RING_BUFFER_CACHE_LINE - 2 * sizeof(uint32_t) - 3 * sizeof(size_t) -
+              sizeof(unsigned int)];
+
+    // 生产者独占缓存行
+    uint64_t tail;          // 写位置, 仅生产者修改
+    uint64_t cached_head;   // 生产者缓存的读位置
+    size_t reserved;        // 已预留但未提交的记录长度
+    char pad1[RING_BUFFER_CACHE_LINE - 2 * sizeof(uint64_t) - sizeof(size_t)];
+
+    // 消费者独占缓存行
+    uint64_t head;          // 读位置, 仅消费者修改
+    uint64_t cached_tail;   // 消费者缓存的写位置
+    char pad2[RING_BUFFER_CACHE_LINE - 2 * sizeof(uint64_t)];
+
+    // 阻塞等待状态, 只有在有线程挂起时才会被写入
+    uint32_t data_seq;      // 等待数据的 futex 字, 生产者发布时递增
+    uint32_t data_waiters;  // 等待数据的线程数
+    uint32_t space_seq;     // 等待空间的 futex 字, 消费者归还空间时递增
+    uint32_t space_waiters; // 等待空间的线程数
+    char pad3[RING_BUFFER_CACHE_LINE - 4 * sizeof(uint32_t)];
+} spsc_ring_buffer_ctrl;
+
+// 单生产者/单消费者队列的进程内句柄
+// 布局在创建/打开时校验并记录在这里, 之后偏移和解除映射的长度只从句柄计算;
+// 共享内存中的控制块可能被另一个进程随时改写, 其中的布局字段不再被读取
+typedef struct {
+    spsc_ring_buffer_ctrl *ctrl;    // 控制块
+    char *data;             // 数据区起始地址
+    size_t capacity;        // 数据区总容量(字节)
+    size_t mask;            // capacity - 1, 容量总是2的幂
+    size_t map_size;        // 镜像映射的总长度, 非镜像队列为0
+    unsigned int flags;     // 创建标志
+} spsc_ring_buffer;
+
+spsc_ring_buffer* spsc_ring_buffer_create(size_t capacity);
+spsc_ring_buffer* spsc_ring_buffer_create_mirrored(size_t capacity);
+spsc_ring_buffer* spsc_ring_buffer_create_ex(size_t capacity, unsigned int flags);
+spsc_ring_buffer* spsc_ring_buffer_create_shm(const char *name, size_t capacity, unsigned int flags);
+spsc_ring_buffer* spsc_ring_buffer_open_shm(const char *name);
+bool spsc_ring_buffer_unlink_shm(const char *name);
+void spsc_ring_buffer_destroy(spsc_ring_buffer *queue);
+bool spsc_ring_buffer_is_empty(const spsc_ring_buffer *queue);
+size_t spsc_ring_buffer_available(const spsc_ring_buffer *queue);
+bool spsc_ring_buffer_enqueue(spsc_ring_buffer *queue, const void *data, size_t data_len);
+bool spsc_ring_buffer_dequeue(spsc_ring_buffer *queue, void *data, size_t *data_len);
+bool spsc_ring_buffer_enqueue_wait(spsc_ring_buffer *queue, const void *data, size_t data_len,
+                                   int timeout_ms);
+bool spsc_ring_buffer_dequeue_wait(spsc_ring_buffer *queue, void *data, size_t *data_len,
+                                   int timeout_ms);
+size_t spsc_ring_buffer_reserve(spsc_ring_buffer *queue, size_t data_len, ring_buffer_span span[2]);
+bool spsc_ring_buffer_commit(spsc_ring_buffer *queue, size_t data_len);
+size_t spsc_ring_buffer_peek(spsc_ring_buffer *queue, ring_buffer_span span[2]);
+bool spsc_ring_buffer_release(spsc_ring_buffer *queue);
+size_t spsc_ring_buffer_enqueue_batch(spsc_ring_buffer *queue, const struct iovec *records,
+                                      size_t count);
+size_t spsc_ring_buffer_dequeue_batch(spsc_ring_buffer *queue, void *data, size_t data_size,
+                                      struct iovec *records, size_t max_records);
+
+// 多生产者/多消费者无锁环形缓冲区, 每个槽位保存一条定长上限的记录
+// 槽位带序号(Vyukov 算法), 生产者/消费者各自用 CAS 抢占位置, 互不加锁
+typedef struct {
+    size_t capacity;        // 槽位数(2的幂)
+    size_t mask;            // capacity - 1
+    size_t record_size;     // 单条记录最大长度(字节)
+    size_t slot_size;       // 槽位步长(字节)
+    char *slots;            // 槽位数组
+    char pad0[RING_BUFFER_CACHE_LINE - 4 * sizeof(size_t) - sizeof(char *)];
+
+    uint64_t enqueue_pos;   // 下一个入队位置
+    char pad1[RING_BUFFER_CACHE_LINE - sizeof(uint64_t)];
+
+    uint64_t dequeue_pos;   // 下一个出队位置
+    char pad2[RING_BUFFER_CACHE_LINE - sizeof(uint64_t)];
+} mpmc_ring_buffer;
+
+mpmc_ring_buffer* mpmc_ring_buffer_create(size_t capacity, size_t record_size);
+void mpmc_ring_buffer_destroy(mpmc_ring_buffer *queue);
+bool mpmc_ring_buffer_is_empty(const mpmc_ring_buffer *queue);
+bool mpmc_ring_buffer_enqueue(mpmc_ring_buffer *queue, const void *data, size_t data_len);
+bool mpmc_ring_buffer_dequeue(mpmc_ring_buffer *queue, void *data, size_t *data_len);
 
 #ifdef __cplusplus
 }
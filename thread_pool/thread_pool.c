@@ -1,96 +1,2471 @@
+#define _GNU_SOURCE
 #include "thread_pool.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
-#define THREADPOOL_FULL -2
-#define THREADPOOL_ERR -1
-#define THREADPOOL_OK 0
+// mbind() policy, from <numaif.h> which is not always installed
+#define THREADPOOL_MPOL_PREFERRED 1
+
+#define THREADPOOL_NODE_PATH "/sys/devices/system/node"
+
+// Starvation protection: every 8th take starts at the normal class and
+// every 16th at the background class, whatever is queued above them
+#define THREADPOOL_NORMAL_TURN 8
+#define THREADPOOL_BACKGROUND_TURN 16
+
+// Passes over all victims before an idle worker goes to sleep
+#define THREADPOOL_STEAL_ROUNDS 2
+
+// Longest a producer blocked on a full queue sleeps before looking for room
+// again, covers a wakeup missed by the fence-free check in threadpool_notify_space
+#define THREADPOOL_SPACE_RECHECK_MS 10
+
+// Default usable stack of a fiber, plus a guard page below it
+#define THREADPOOL_FIBER_STACK (64 * 1024)
+
+// Finished fibers kept for reuse, beyond this their stacks are unmapped
+#define THREADPOOL_FIBER_CACHE 256
+
+// Fiber states (threadpool_fiber_t.state)
+#define THREADPOOL_FIBER_RUNNING 0
+#define THREADPOOL_FIBER_YIELDED 1  // Wants to be queued again
+#define THREADPOOL_FIBER_PARKED 2   // Waiting for threadpool_fiber_wake
+#define THREADPOOL_FIBER_DONE 3     // Function returned, stack can be reused
+
+struct threadpool_fiber {
+    ucontext_t context;       // Saved registers and stack while switched out
+    ucontext_t *caller;       // Context of the thread currently running the fiber
+    threadpool_t *pool;
+    void (*function)(void *);
+    void *argument;
+    int state;
+    void (*park)(threadpool_fiber_t *, void *); // Called once the fiber is switched out
+    void *park_ctx;
+    threadpool_fiber_t *next; // fiber_cache or wait-group list link
+    char *stack;              // Mapping, guard page first
+    size_t map_size;
+};
+
+// Timing wheel: 256 one-tick slots, then 4 levels of 64 slots each
+// covering 64 times the range of the level below, 2^32 ticks in all
+#define THREADPOOL_TICK_NS 1000000
+#define THREADPOOL_WHEEL_ROOT_BITS 8
+#define THREADPOOL_WHEEL_BITS 6
+#define THREADPOOL_WHEEL_LEVELS 5
+#define THREADPOOL_WHEEL_ROOT (1 << THREADPOOL_WHEEL_ROOT_BITS)
+#define THREADPOOL_WHEEL_SIZE (1 << THREADPOOL_WHEEL_BITS)
+#define THREADPOOL_WHEEL_SLOTS (THREADPOOL_WHEEL_ROOT + (THREADPOOL_WHEEL_LEVELS - 1) * THREADPOOL_WHEEL_SIZE)
+
+// Due timers handed to threadpool_add_batch at a time
+#define THREADPOOL_TIMER_BATCH 64
+
+// Worker slot states (threadpool_worker_t.state)
+#define THREADPOOL_SLOT_FREE 0     // No thread
+#define THREADPOOL_SLOT_RUNNING 1  // Thread started
+#define THREADPOOL_SLOT_EXITED 2   // Thread exited, waiting to be joined
+
+// Worker bound to the calling thread, NULL outside per-worker mode threads
+static __thread threadpool_worker_t *current_worker = NULL;
+
+// Pool the calling thread works for, in every mode
+static __thread threadpool_t *current_pool = NULL;
+
+// Victim selection state for threads helping from outside the pool
+static __thread unsigned int helper_seed = 1;
+
+// Tasks taken by the calling thread, drives the priority class rotation
+static __thread unsigned int take_count = 0;
+
+// Fiber running on the calling thread
+static __thread threadpool_fiber_t *current_fiber = NULL;
+
+static int threadpool_deque_init(threadpool_deque_t *deque, int capacity)
+{
+    int64_t size = 1;
+    while(size < capacity) {
+        size <<= 1;
+    }
+
+    deque->tasks = (threadpool_task_t *)malloc(sizeof(threadpool_task_t) * size);
+    if(deque->tasks == NULL) {
+        return THREADPOOL_ERR;
+    }
+
+    deque->top = 0;
+    deque->bottom = 0;
+    deque->mask = size - 1;
+    return THREADPOOL_OK;
+}
+
+// Owner only. Returns false when the deque is full.
+static bool threadpool_deque_push(threadpool_deque_t *deque, const threadpool_task_t *task, int64_t stamp)
+{
+    int64_t b = __atomic_load_n(&(deque->bottom), __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&(deque->top), __ATOMIC_ACQUIRE);
+    if(b - t > deque->mask) {
+        return false;
+    }
+
+    threadpool_task_t *slot = &(deque->tasks[b & deque->mask]);
+    __atomic_store_n(&(slot->function), task->function, __ATOMIC_RELAXED);
+    __atomic_store_n(&(slot->argument), task->argument, __ATOMIC_RELAXED);
+    __atomic_store_n(&(slot->enqueue_ns), stamp, __ATOMIC_RELAXED);
+
+    // Publish the slot before the new bottom
+    __atomic_store_n(&(deque->bottom), b + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Owner only. Takes the most recently pushed task (LIFO).
+static bool threadpool_deque_pop(threadpool_deque_t *deque, threadpool_task_t *task)
+{
+    int64_t b = __atomic_load_n(&(deque->bottom), __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&(deque->bottom), b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&(deque->top), __ATOMIC_RELAXED);
+
+    if(t > b) {
+        // Empty
+        __atomic_store_n(&(deque->bottom), b + 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    threadpool_task_t *slot = &(deque->tasks[b & deque->mask]);
+    task->function = __atomic_load_n(&(slot->function), __ATOMIC_RELAXED);
+    task->argument = __atomic_load_n(&(slot->argument), __ATOMIC_RELAXED);
+    task->enqueue_ns = __atomic_load_n(&(slot->enqueue_ns), __ATOMIC_RELAXED);
+    if(t < b) {
+        return true;
+    }
+
+    // Last task, race against thieves for it
+    bool won = __atomic_compare_exchange_n(&(deque->top), &t, t + 1, false,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    __atomic_store_n(&(deque->bottom), b + 1, __ATOMIC_RELAXED);
+    return won;
+}
+
+// Tasks waiting in the deque, a snapshot when other threads are active
+static int64_t threadpool_deque_depth(threadpool_deque_t *deque)
+{
+    int64_t depth = __atomic_load_n(&(deque->bottom), __ATOMIC_RELAXED) -
+                    __atomic_load_n(&(deque->top), __ATOMIC_RELAXED);
+    return depth > 0 ? depth : 0;
+}
+
+// Any thread. Takes the oldest task (FIFO).
+// Returns 1 on success, 0 when empty, -1 when another thread won the race.
+static int threadpool_deque_steal(threadpool_deque_t *deque, threadpool_task_t *task)
+{
+    int64_t t = __atomic_load_n(&(deque->top), __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&(deque->bottom), __ATOMIC_ACQUIRE);
+    if(t >= b) {
+        return 0;
+    }
+
+    // The slot may be overwritten once top moves on, the CAS below rejects that case
+    threadpool_task_t *slot = &(deque->tasks[t & deque->mask]);
+    task->function = __atomic_load_n(&(slot->function), __ATOMIC_RELAXED);
+    task->argument = __atomic_load_n(&(slot->argument), __ATOMIC_RELAXED);
+    task->enqueue_ns = __atomic_load_n(&(slot->enqueue_ns), __ATOMIC_RELAXED);
+    if(!__atomic_compare_exchange_n(&(deque->top), &t, t + 1, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    return 1;
+}
+
+// Allocate size bytes preferring memory on NUMA node, or with malloc() when
+// node is negative. Sets *map_size to the mapped length, 0 for malloc().
+static void *threadpool_node_alloc(size_t size, int node, size_t *map_size)
+{
+    *map_size = 0;
+    if(node < 0) {
+        return malloc(size);
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    size_t len = (size + page - 1) / page * page;
+    void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(addr == MAP_FAILED) {
+        return NULL;
+    }
+
+    // Pages are placed on first touch, so the policy only has to be set
+    // before the caller initializes them. Without mbind (or NUMA) the kernel
+    // default policy applies.
+    unsigned long mask[node / (8 * sizeof(unsigned long)) + 1];
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, addr, len, THREADPOOL_MPOL_PREFERRED, mask, 8 * sizeof(mask) + 1, 0);
+
+    *map_size = len;
+    return addr;
+}
+
+static void threadpool_node_free(void *addr, size_t map_size)
+{
+    if(map_size > 0) {
+        munmap(addr, map_size);
+    } else {
+        free(addr);
+    }
+}
+
+// node is the NUMA node to place the slots on, -1 for no preference
+static int threadpool_mpmc_init(threadpool_mpmc_t *queue, int capacity, int node)
+{
+    uint64_t size = 1;
+    while(size < (uint64_t)capacity) {
+        size <<= 1;
+    }
+
+    queue->slots = (threadpool_slot_t *)threadpool_node_alloc(sizeof(threadpool_slot_t) * size,
+                                                              node, &(queue->map_size));
+    if(queue->slots == NULL) {
+        return THREADPOOL_ERR;
+    }
+
+    for(uint64_t i = 0; i < size; i++) {
+        queue->slots[i].seq = i;
+    }
+    queue->enqueue_pos = 0;
+    queue->dequeue_pos = 0;
+    queue->mask = size - 1;
+    return THREADPOOL_OK;
+}
+
+static void threadpool_mpmc_free(threadpool_mpmc_t *queue)
+{
+    if(queue->slots != NULL) {
+        threadpool_node_free(queue->slots, queue->map_size);
+        queue->slots = NULL;
+    }
+}
+
+// Claims a run of free slots with one CAS and fills them, stamping each
+// task with stamp. Returns the number of tasks queued, 0 when full.
+static int threadpool_mpmc_push(threadpool_mpmc_t *queue, const threadpool_task_t *tasks, int count, int64_t stamp)
+{
+    uint64_t pos = __atomic_load_n(&(queue->enqueue_pos), __ATOMIC_RELAXED);
+
+    for(;;) {
+        int n = 0;
+        int64_t diff = 0;
+        while(n < count && (uint64_t)n <= queue->mask) {
+            threadpool_slot_t *slot = &(queue->slots[(pos + n) & queue->mask]);
+            diff = (int64_t)(__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) - (pos + n));
+            if(diff != 0) {
+                break;
+            }
+            n++;
+        }
+
+        if(n == 0) {
+            // The slot still holds a task from the previous lap
+            if(diff < 0) {
+                return 0;
+            }
+            // Another producer claimed pos
+            pos = __atomic_load_n(&(queue->enqueue_pos), __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if(__atomic_compare_exchange_n(&(queue->enqueue_pos), &pos, pos + n, true,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            for(int i = 0; i < n; i++) {
+                threadpool_slot_t *slot = &(queue->slots[(pos + i) & queue->mask]);
+                slot->task = tasks[i];
+                slot->task.enqueue_ns = stamp;
+                __atomic_store_n(&(slot->seq), pos + i + 1, __ATOMIC_RELEASE);
+            }
+            return n;
+        }
+    }
+}
+
+static bool threadpool_mpmc_pop(threadpool_mpmc_t *queue, threadpool_task_t *task)
+{
+    uint64_t pos = __atomic_load_n(&(queue->dequeue_pos), __ATOMIC_RELAXED);
+
+    for(;;) {
+        threadpool_slot_t *slot = &(queue->slots[pos & queue->mask]);
+        int64_t diff = (int64_t)(__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) - (pos + 1));
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&(queue->dequeue_pos), &pos, pos + 1, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *task = slot->task;
+                // Free the slot for the producer one lap ahead
+                __atomic_store_n(&(slot->seq), pos + queue->mask + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if(diff < 0) {
+            // Empty, or the producer has claimed but not yet filled the slot
+            return false;
+        } else {
+            pos = __atomic_load_n(&(queue->dequeue_pos), __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static int64_t threadpool_mpmc_depth(threadpool_mpmc_t *queue)
+{
+    return (int64_t)(__atomic_load_n(&(queue->enqueue_pos), __ATOMIC_RELAXED) -
+                     __atomic_load_n(&(queue->dequeue_pos), __ATOMIC_RELAXED));
+}
+
+static bool threadpool_mpmc_busy(threadpool_mpmc_t *queue)
+{
+    return __atomic_load_n(&(queue->enqueue_pos), __ATOMIC_ACQUIRE) !=
+           __atomic_load_n(&(queue->dequeue_pos), __ATOMIC_ACQUIRE);
+}
+
+// True when the shared queue holds (or is about to hold) a task
+static bool threadpool_shared_busy(threadpool_t *pool)
+{
+    if(pool->lfqueue != NULL) {
+        return threadpool_mpmc_busy(pool->lfqueue);
+    }
+    return __atomic_load_n(&(pool->count), __ATOMIC_RELAXED) > 0;
+}
+
+static bool threadpool_nodes_busy(threadpool_t *pool)
+{
+    for(int i = 0; i < pool->node_count; i++) {
+        if(threadpool_mpmc_busy(&(pool->nodes[i].queue))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool threadpool_deques_busy(threadpool_t *pool)
+{
+    if(!(pool->flags & THREADPOOL_WORK_STEALING)) {
+        return false;
+    }
+    for(int i = 0; i < pool->worker_count; i++) {
+        threadpool_deque_t *deque = &(pool->workers[i].deque);
+        if(__atomic_load_n(&(deque->bottom), __ATOMIC_ACQUIRE) >
+           __atomic_load_n(&(deque->top), __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool threadpool_classes_busy(threadpool_t *pool)
+{
+    for(int i = 0; i < THREADPOOL_PRIORITY_COUNT; i++) {
+        if(pool->class_queues[i] != NULL && threadpool_mpmc_busy(pool->class_queues[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool threadpool_has_work(threadpool_t *pool)
+{
+    return threadpool_shared_busy(pool) || threadpool_nodes_busy(pool) ||
+           threadpool_classes_busy(pool) || threadpool_deques_busy(pool);
+}
+
+// Number of tasks waiting in the shared queue
+static int64_t threadpool_pending(threadpool_t *pool)
+{
+    if(pool->lfqueue != NULL) {
+        return threadpool_mpmc_depth(pool->lfqueue);
+    }
+    return __atomic_load_n(&(pool->count), __ATOMIC_RELAXED);
+}
+
+static inline void threadpool_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Spin, then yield, for pool->spin_count rounds before parking so a burst
+// finds the worker awake. Returns true when work showed up, false on timeout
+// or shutdown, which the parking path handles.
+static bool threadpool_spin(threadpool_t *pool)
+{
+    for(int i = 0; i < pool->spin_count; i++) {
+        if(__atomic_load_n(&(pool->shutdown), __ATOMIC_RELAXED)) {
+            return false;
+        }
+        if(threadpool_has_work(pool)) {
+            return true;
+        }
+        if(i < pool->spin_count / 2) {
+            threadpool_cpu_relax();
+        } else {
+            sched_yield();
+        }
+    }
+    return false;
+}
+
+// Wake up to count sleeping workers, pool->lock held
+static void threadpool_signal_locked(threadpool_t *pool, int count)
+{
+    if(count >= pool->idle) {
+        pthread_cond_broadcast(&(pool->notify));
+        return;
+    }
+    for(int i = 0; i < count; i++) {
+        pthread_cond_signal(&(pool->notify));
+    }
+}
+
+// Wake up to count sleeping workers after publishing tasks without holding pool->lock
+static void threadpool_wake_idle(threadpool_t *pool, int count)
+{
+    // Pairs with the fence after idle++ in the sleeping worker: either it
+    // sees the new task or we see it counted as idle
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&(pool->idle), __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&(pool->lock));
+        if(pool->idle > 0) {
+            threadpool_signal_locked(pool, count);
+        }
+        pthread_mutex_unlock(&(pool->lock));
+    }
+}
+
+// A task left a queue: wake producers blocked on a full queue, if any.
+// Runs for every task, so there is no fence: a waiter registering just as
+// this misses it finds the room on its next bounded recheck.
+static void threadpool_notify_space(threadpool_t *pool)
+{
+    if(__atomic_load_n(&(pool->space_waiters), __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&(pool->space_lock));
+        pthread_cond_broadcast(&(pool->space));
+        pthread_mutex_unlock(&(pool->space_lock));
+    }
+}
+
+static bool threadpool_take_global(threadpool_t *pool, threadpool_task_t *task)
+{
+    if(pool->lfqueue != NULL) {
+        return threadpool_mpmc_pop(pool->lfqueue, task);
+    }
+
+    // Peek without the lock so an empty shared queue costs nothing
+    if(__atomic_load_n(&(pool->count), __ATOMIC_RELAXED) == 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&(pool->lock));
+    bool found = pool->count > 0;
+    if(found) {
+        *task = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->queue_size;
+        __atomic_store_n(&(pool->count), pool->count - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    return found;
+}
+
+int64_t threadpool_clock_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Submission time for queue-wait accounting, 0 when stats are off
+static inline int64_t threadpool_stamp(threadpool_t *pool)
+{
+    return pool->stats != NULL ? threadpool_clock_ns() : 0;
+}
+
+// Counters of the calling thread: its worker slot, or the slot shared by
+// threads helping from outside the pool
+static inline threadpool_worker_stats_t *threadpool_my_stats(threadpool_t *pool, threadpool_worker_t *self)
+{
+    return &(pool->stats[self != NULL ? self->index : pool->worker_count]);
+}
+
+static int threadpool_histogram_index(uint64_t value)
+{
+    if(value < (1u << THREADPOOL_HISTOGRAM_SUB_BITS)) {
+        return (int)value;
+    }
+    // Octave from the highest set bit, then the next SUB_BITS bits below it
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - THREADPOOL_HISTOGRAM_SUB_BITS;
+    int sub = (int)((value >> shift) & ((1u << THREADPOOL_HISTOGRAM_SUB_BITS) - 1));
+    return ((shift + 1) << THREADPOOL_HISTOGRAM_SUB_BITS) + sub;
+}
+
+// Highest value counted in bucket index
+static uint64_t threadpool_histogram_value(int index)
+{
+    if(index < (1 << THREADPOOL_HISTOGRAM_SUB_BITS)) {
+        return (uint64_t)index;
+    }
+    int shift = (index >> THREADPOOL_HISTOGRAM_SUB_BITS) - 1;
+    uint64_t top = (uint64_t)((index & ((1 << THREADPOOL_HISTOGRAM_SUB_BITS) - 1)) |
+                              (1 << THREADPOOL_HISTOGRAM_SUB_BITS));
+    return ((top + 1) << shift) - 1;
+}
+
+static void threadpool_histogram_record(threadpool_histogram_t *hist, int64_t value)
+{
+    uint64_t v = value > 0 ? (uint64_t)value : 0;
+    __atomic_fetch_add(&(hist->count), 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(hist->sum), v, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(hist->buckets[threadpool_histogram_index(v)]), 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&(hist->max), __ATOMIC_RELAXED);
+    while(v > max && !__atomic_compare_exchange_n(&(hist->max), &max, v, true,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void threadpool_histogram_merge(threadpool_histogram_t *dst, threadpool_histogram_t *src)
+{
+    dst->count += __atomic_load_n(&(src->count), __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&(src->sum), __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&(src->max), __ATOMIC_RELAXED);
+    if(max > dst->max) {
+        dst->max = max;
+    }
+    for(int i = 0; i < THREADPOOL_HISTOGRAM_BUCKETS; i++) {
+        dst->buckets[i] += __atomic_load_n(&(src->buckets[i]), __ATOMIC_RELAXED);
+    }
+}
+
+// Raise the queue depth high-water mark to depth
+static void threadpool_note_depth(threadpool_t *pool, int64_t depth)
+{
+    if(pool->stats == NULL) {
+        return;
+    }
+    int64_t high = __atomic_load_n(&(pool->queue_high_water), __ATOMIC_RELAXED);
+    while(depth > high && !__atomic_compare_exchange_n(&(pool->queue_high_water), &high, depth, true,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void threadpool_note_rejected(threadpool_t *pool, int count)
+{
+    if(pool->stats != NULL && count > 0) {
+        __atomic_fetch_add(&(pool->rejected), (uint64_t)count, __ATOMIC_RELAXED);
+    }
+}
+
+// Close the worker's current idle period, owner only
+static void threadpool_idle_end(threadpool_worker_stats_t *stats)
+{
+    int64_t since = stats->idle_since;
+    __atomic_store_n(&(stats->idle_since), 0, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(stats->idle_ns), (uint64_t)(threadpool_clock_ns() - since), __ATOMIC_RELAXED);
+}
+
+// Idle time of a worker including the period it is in right now
+static uint64_t threadpool_idle_total(threadpool_worker_stats_t *stats, int64_t now)
+{
+    uint64_t total = __atomic_load_n(&(stats->idle_ns), __ATOMIC_RELAXED);
+    int64_t since = __atomic_load_n(&(stats->idle_since), __ATOMIC_RELAXED);
+    if(since > 0 && now > since) {
+        total += (uint64_t)(now - since);
+    }
+    return total;
+}
+
+// Run a task on the calling thread, timing it when stats are on
+static void threadpool_run_task(threadpool_t *pool, threadpool_worker_t *self, threadpool_task_t *task)
+{
+    threadpool_notify_space(pool);
+
+    if(pool->stats == NULL) {
+        (*(task->function))(task->argument);
+        return;
+    }
+
+    threadpool_worker_stats_t *stats = threadpool_my_stats(pool, self);
+    int64_t start = threadpool_clock_ns();
+    if(task->enqueue_ns > 0) {
+        threadpool_histogram_record(&(stats->wait_ns), start - task->enqueue_ns);
+    }
+
+    (*(task->function))(task->argument);
+
+    int64_t run = threadpool_clock_ns() - start;
+    threadpool_histogram_record(&(stats->run_ns), run);
+    __atomic_fetch_add(&(stats->tasks), 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(stats->busy_ns), (uint64_t)run, __ATOMIC_RELAXED);
+}
+
+// Shared queues in locality order: the worker's node queue, the pool-wide
+// queue, then the other nodes' queues. self may be NULL.
+static bool threadpool_take_shared(threadpool_t *pool, threadpool_worker_t *self, threadpool_task_t *task)
+{
+    int home = (self != NULL) ? self->node : -1;
+    if(home >= 0 && threadpool_mpmc_pop(&(pool->nodes[home].queue), task)) {
+        return true;
+    }
+    if(threadpool_take_global(pool, task)) {
+        return true;
+    }
+    for(int i = 0; i < pool->node_count; i++) {
+        if(i != home && threadpool_mpmc_pop(&(pool->nodes[i].queue), task)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// self is NULL when called from a thread outside the pool
+static bool threadpool_steal(threadpool_t *pool, threadpool_worker_t *self, threadpool_task_t *task)
+{
+    int n = pool->worker_count;
+    unsigned int *seed = self ? &(self->seed) : &helper_seed;
+
+    for(int round = 0; round < THREADPOOL_STEAL_ROUNDS; round++) {
+        bool contended = false;
+        int start = rand_r(seed) % n;
+        for(int i = 0; i < n; i++) {
+            threadpool_worker_t *victim = &(pool->workers[(start + i) % n]);
+            if(victim == self) {
+                continue;
+            }
+
+            int ret = threadpool_deque_steal(&(victim->deque), task);
+            if(ret > 0) {
+                if(pool->stats != NULL) {
+                    __atomic_fetch_add(&(threadpool_my_stats(pool, self)->steals), 1, __ATOMIC_RELAXED);
+                }
+                return true;
+            }
+            if(ret < 0) {
+                contended = true;
+            }
+        }
+
+        // Only retry when some deque was non-empty but we lost the race
+        if(!contended) {
+            break;
+        }
+    }
+    return false;
+}
+
+// The normal class: the worker's own deque, the shared queues, then other
+// workers' deques. Deques only ever hold normal tasks, so higher classes
+// never wait behind local work. self may be NULL.
+static bool threadpool_take_normal(threadpool_t *pool, threadpool_worker_t *self, threadpool_task_t *task)
+{
+    bool stealing = (pool->flags & THREADPOOL_WORK_STEALING) != 0;
+    return (stealing && self != NULL && threadpool_deque_pop(&(self->deque), task)) ||
+           threadpool_take_shared(pool, self, task) ||
+           (stealing && threadpool_steal(pool, self, task));
+}
+
+// Take from the high, normal and background classes in order, except on
+// the turns reserved for the lower classes. Normal tasks live in the
+// workers' deques and the regular shared queues.
+static bool threadpool_take_prioritized(threadpool_t *pool, threadpool_worker_t *self, threadpool_task_t *task)
+{
+    if(!(pool->flags & THREADPOOL_PRIORITIES)) {
+        return threadpool_take_normal(pool, self, task);
+    }
+
+    unsigned int turn = ++take_count;
+    int start = THREADPOOL_PRIORITY_HIGH;
+    if(turn % THREADPOOL_BACKGROUND_TURN == 0) {
+        start = THREADPOOL_PRIORITY_BACKGROUND;
+    } else if(turn % THREADPOOL_NORMAL_TURN == 0) {
+        start = THREADPOOL_PRIORITY_NORMAL;
+    }
+
+    for(int i = 0; i < THREADPOOL_PRIORITY_COUNT; i++) {
+        int priority = (start + i) % THREADPOOL_PRIORITY_COUNT;
+        if(priority == THREADPOOL_PRIORITY_NORMAL) {
+            if(threadpool_take_normal(pool, self, task)) {
+                return true;
+            }
+        } else if(threadpool_mpmc_pop(pool->class_queues[priority], task)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Run one queued task on the calling thread, used by waiters to help
+// instead of blocking. Returns false when no task was available.
+static bool threadpool_run_one(threadpool_t *pool)
+{
+    threadpool_task_t task;
+
+    if(pool == NULL || __atomic_load_n(&(pool->shutdown), __ATOMIC_RELAXED) == 1) {
+        return false;
+    }
+
+    threadpool_worker_t *self = current_worker;
+    if(self != NULL && self->pool != pool) {
+        self = NULL;
+    }
+
+    if(threadpool_take_prioritized(pool, self, &task)) {
+        threadpool_run_task(pool, self, &task);
+        return true;
+    }
+    return false;
+}
+
+static void *threadpool_worker_thread(void *arg)
+{
+    threadpool_worker_t *worker = (threadpool_worker_t *)arg;
+    threadpool_t *pool = worker->pool;
+    threadpool_task_t task;
+    bool retire = false;
+    int64_t *idle_since = (pool->stats != NULL) ? &(pool->stats[worker->index].idle_since) : NULL;
+
+    current_worker = worker;
+    current_pool = pool;
+
+    for(;;) {
+        // Close immediately
+        if(__atomic_load_n(&(pool->shutdown), __ATOMIC_RELAXED) == 1) {
+            pthread_mutex_lock(&(pool->lock));
+            break;
+        }
+
+        // By class, and within a class local tasks first, then the shared
+        // queues, then other workers
+        if(threadpool_take_prioritized(pool, worker, &task)) {
+            if(idle_since != NULL && *idle_since > 0) {
+                threadpool_idle_end(&(pool->stats[worker->index]));
+            }
+            threadpool_run_task(pool, worker, &task);
+            continue;
+        }
+
+        // Idle time covers spinning and parking until the next task
+        if(idle_since != NULL && *idle_since == 0) {
+            __atomic_store_n(idle_since, threadpool_clock_ns(), __ATOMIC_RELAXED);
+        }
+
+        if(threadpool_spin(pool)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&(pool->lock));
+        __atomic_add_fetch(&(pool->idle), 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        // Threads above min_threads park with a timeout and retire when it expires
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += pool->idle_timeout_ms / 1000;
+        deadline.tv_nsec += (long)(pool->idle_timeout_ms % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while(!threadpool_has_work(pool) && !pool->shutdown) {
+            if(pool->thread_count <= pool->min_threads) {
+                pthread_cond_wait(&(pool->notify), &(pool->lock));
+            } else if(pthread_cond_timedwait(&(pool->notify), &(pool->lock), &deadline) == ETIMEDOUT &&
+                      !threadpool_has_work(pool) && !pool->shutdown &&
+                      pool->thread_count > pool->min_threads) {
+                retire = true;
+                break;
+            }
+        }
+        __atomic_sub_fetch(&(pool->idle), 1, __ATOMIC_RELAXED);
+
+        if(retire || pool->shutdown == 1) {
+            break;
+        }
+
+        // Close after all queues and deques are drained
+        if(pool->shutdown == 2 && !threadpool_has_work(pool)) {
+            break;
+        }
+
+        pthread_mutex_unlock(&(pool->lock));
+    }
+
+    if(idle_since != NULL && *idle_since > 0) {
+        threadpool_idle_end(&(pool->stats[worker->index]));
+    }
+
+    current_worker = NULL;
+    __atomic_sub_fetch(&(pool->thread_count), 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&(worker->state), THREADPOOL_SLOT_EXITED, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&(pool->lock));
+    pthread_exit(NULL);
+    return NULL;
+}
 
 static void *threadpool_thread(void *threadpool)
 {
-    threadpool_t *pool = (threadpool_t *)threadpool;
-    threadpool_task_t task;
+    threadpool_t *pool = (threadpool_t *)threadpool;
+    threadpool_task_t task;
+
+    current_pool = pool;
+
+    for(;;) {
+        pthread_mutex_lock(&(pool->lock));
+
+        // Wait for the task or close the notification
+        while(pool->count == 0 && !pool->shutdown) {
+            __atomic_add_fetch(&(pool->idle), 1, __ATOMIC_RELAXED);
+            pthread_cond_wait(&(pool->notify), &(pool->lock));
+            __atomic_sub_fetch(&(pool->idle), 1, __ATOMIC_RELAXED);
+        }
+
+        // Close immediately
+        if(pool->shutdown == 1) {
+            break;
+        }
+
+        // Close after completing the remaining tasks
+        if(pool->shutdown == 2 && pool->count == 0) {
+            break;
+        }
+
+        // Obtain the task
+        task.function = pool->queue[pool->head].function;
+        task.argument = pool->queue[pool->head].argument;
+        pool->head = (pool->head + 1) % pool->queue_size;
+        __atomic_store_n(&(pool->count), pool->count - 1, __ATOMIC_RELAXED);
+
+        pthread_mutex_unlock(&(pool->lock));
+        threadpool_notify_space(pool);
+
+        // run the task
+        (*(task.function))(task.argument);
+    }
+
+    __atomic_sub_fetch(&(pool->thread_count), 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&(pool->lock));
+    pthread_exit(NULL);
+    return NULL;
+}
+
+// CPUs the thread of slot index may run on. Returns false when unpinned.
+static bool threadpool_slot_cpuset(threadpool_t *pool, int index, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    if(pool->cpu_count > 0) {
+        CPU_SET(pool->cpus[index % pool->cpu_count], set);
+        return true;
+    }
+
+    int node = (pool->workers != NULL) ? pool->workers[index].node : -1;
+    if(node < 0 || pool->nodes[node].cpu_count == 0) {
+        return false;
+    }
+    for(int i = 0; i < pool->nodes[node].cpu_count; i++) {
+        CPU_SET(pool->nodes[node].cpus[i], set);
+    }
+    return true;
+}
+
+// Start the thread of slot index with its affinity set from the first instruction
+static int threadpool_spawn(threadpool_t *pool, int index, void *(*routine)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    cpu_set_t set;
+
+    if(pthread_attr_init(&attr) != 0) {
+        return THREADPOOL_ERR;
+    }
+    if(threadpool_slot_cpuset(pool, index, &set) &&
+       pthread_attr_setaffinity_np(&attr, sizeof(set), &set) != 0) {
+        pthread_attr_destroy(&attr);
+        return THREADPOOL_ERR;
+    }
+
+    int ret = pthread_create(&(pool->threads[index]), &attr, routine, arg);
+    pthread_attr_destroy(&attr);
+    return ret == 0 ? THREADPOOL_OK : THREADPOOL_ERR;
+}
+
+// Start another worker in a free slot, pool->lock held
+static void threadpool_grow_locked(threadpool_t *pool)
+{
+    if(pool->shutdown || pool->idle > 0 || pool->thread_count >= pool->max_threads) {
+        return;
+    }
+
+    for(int i = 0; i < pool->worker_count; i++) {
+        threadpool_worker_t *worker = &(pool->workers[i]);
+        int state = __atomic_load_n(&(worker->state), __ATOMIC_ACQUIRE);
+        if(state == THREADPOOL_SLOT_RUNNING) {
+            continue;
+        }
+
+        // A retired thread has already released the lock on its way out
+        if(state == THREADPOOL_SLOT_EXITED) {
+            pthread_join(pool->threads[i], NULL);
+        }
+
+        __atomic_store_n(&(worker->state), THREADPOOL_SLOT_RUNNING, __ATOMIC_RELAXED);
+        if(threadpool_spawn(pool, i, threadpool_worker_thread, worker) != THREADPOOL_OK) {
+            __atomic_store_n(&(worker->state), THREADPOOL_SLOT_FREE, __ATOMIC_RELAXED);
+            return;
+        }
+        __atomic_add_fetch(&(pool->thread_count), 1, __ATOMIC_RELAXED);
+        return;
+    }
+}
+
+// The queue just added to is backing up: nobody is idle and it holds at
+// least one waiting task per running worker
+static bool threadpool_should_grow(threadpool_t *pool, int64_t backlog)
+{
+    int threads = __atomic_load_n(&(pool->thread_count), __ATOMIC_RELAXED);
+    return threads < pool->max_threads &&
+           __atomic_load_n(&(pool->idle), __ATOMIC_RELAXED) == 0 &&
+           backlog >= threads;
+}
+
+// Growth check for the paths that do not hold pool->lock, which is only
+// taken once a new worker is actually needed
+static void threadpool_maybe_grow(threadpool_t *pool, int64_t backlog)
+{
+    if(threadpool_should_grow(pool, backlog)) {
+        pthread_mutex_lock(&(pool->lock));
+        threadpool_grow_locked(pool);
+        pthread_mutex_unlock(&(pool->lock));
+    }
+}
+
+// Double the shared circular buffer, up to max_queue_size, pool->lock held
+static bool threadpool_grow_queue_locked(threadpool_t *pool)
+{
+    if(pool->overflow != THREADPOOL_OVERFLOW_GROW || pool->queue_size >= pool->max_queue_size) {
+        return false;
+    }
+
+    int size = pool->queue_size;
+    size = (size > pool->max_queue_size / 2) ? pool->max_queue_size : size * 2;
+    threadpool_task_t *queue = (threadpool_task_t *)malloc(sizeof(threadpool_task_t) * size);
+    if(queue == NULL) {
+        return false;
+    }
+
+    // Unwrap the pending tasks to the front of the new buffer
+    for(int i = 0; i < pool->count; i++) {
+        queue[i] = pool->queue[(pool->head + i) % pool->queue_size];
+    }
+    free(pool->queue);
+    pool->queue = queue;
+    pool->head = 0;
+    pool->tail = pool->count;
+    pool->queue_size = size;
+    return true;
+}
+
+// Queue tasks on the shared queue and wake workers for them.
+// Returns the number queued or THREADPOOL_ERR when closing.
+static int threadpool_enqueue_shared(threadpool_t *pool, const threadpool_task_t *tasks, int count)
+{
+    if(pool->lfqueue != NULL) {
+        if(__atomic_load_n(&(pool->shutdown), __ATOMIC_RELAXED)) {
+            return THREADPOOL_ERR;
+        }
+        int added = threadpool_mpmc_push(pool->lfqueue, tasks, count, threadpool_stamp(pool));
+        if(added > 0) {
+            int64_t depth = threadpool_mpmc_depth(pool->lfqueue);
+            threadpool_note_depth(pool, depth);
+            threadpool_wake_idle(pool, added);
+            threadpool_maybe_grow(pool, depth);
+        }
+        return added;
+    }
+
+    if(pthread_mutex_lock(&(pool->lock)) != 0) {
+        return THREADPOOL_ERR;
+    }
+
+    // closing
+    if(pool->shutdown) {
+        pthread_mutex_unlock(&(pool->lock));
+        return THREADPOOL_ERR;
+    }
+
+    // add as many tasks as fit
+    int64_t stamp = threadpool_stamp(pool);
+    int added = 0;
+    while(added < count) {
+        if(pool->count == pool->queue_size && !threadpool_grow_queue_locked(pool)) {
+            break;
+        }
+        pool->queue[pool->tail] = tasks[added];
+        pool->queue[pool->tail].enqueue_ns = stamp;
+        pool->tail = (pool->tail + 1) % pool->queue_size;
+        __atomic_store_n(&(pool->count), pool->count + 1, __ATOMIC_RELAXED);
+        added++;
+    }
+    threadpool_note_depth(pool, pool->count);
+
+    // Notify waiting workers, one per task at most
+    if(added > 0 && pool->idle > 0) {
+        threadpool_signal_locked(pool, added);
+    } else if(added > 0 && threadpool_should_grow(pool, pool->count)) {
+        threadpool_grow_locked(pool);
+    }
+
+    pthread_mutex_unlock(&(pool->lock));
+    return added;
+}
+
+// Push tasks to the calling worker's deque when it belongs to pool.
+// Returns the number pushed.
+static int threadpool_push_local(threadpool_t *pool, const threadpool_task_t *tasks, int count)
+{
+    // Tasks added from one of this pool's workers stay on its deque,
+    // falling back to the shared queue when the deque is full
+    threadpool_worker_t *worker = current_worker;
+    if(worker == NULL || worker->pool != pool ||
+       !(pool->flags & THREADPOOL_WORK_STEALING) ||
+       __atomic_load_n(&(pool->shutdown), __ATOMIC_RELAXED) == 1) {
+        return 0;
+    }
+
+    int64_t stamp = threadpool_stamp(pool);
+    int pushed = 0;
+    while(pushed < count && threadpool_deque_push(&(worker->deque), &(tasks[pushed]), stamp)) {
+        pushed++;
+    }
+    if(pushed > 0) {
+        threadpool_wake_idle(pool, pushed);
+        threadpool_maybe_grow(pool, threadpool_deque_depth(&(worker->deque)));
+    }
+    return pushed;
+}
+
+// Push tasks to the node queue of the calling worker when it belongs to a
+// NUMA pool, so they stay on its node. Returns the number pushed.
+static int threadpool_push_node(threadpool_t *pool, const threadpool_task_t *tasks, int count)
+{
+    threadpool_worker_t *worker = current_worker;
+    if(worker == NULL || worker->pool != pool || worker->node < 0 ||
+       __atomic_load_n(&(pool->shutdown), __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    threadpool_mpmc_t *queue = &(pool->nodes[worker->node].queue);
+    int pushed = threadpool_mpmc_push(queue, tasks, count, threadpool_stamp(pool));
+    if(pushed > 0) {
+        int64_t depth = threadpool_mpmc_depth(queue);
+        threadpool_note_depth(pool, depth);
+        threadpool_wake_idle(pool, pushed);
+        threadpool_maybe_grow(pool, depth);
+    }
+    return pushed;
+}
+
+// Queue one task on queue (a node or class queue), or on the shared queue
+// when queue is NULL, and wake a worker for it
+static int threadpool_try_push(threadpool_t *pool, const threadpool_task_t *task, threadpool_mpmc_t *queue)
+{
+    if(queue == NULL) {
+        int ret = threadpool_enqueue_shared(pool, task, 1);
+        if(ret < 0) {
+            return ret;
+        }
+        return ret == 1 ? THREADPOOL_OK : THREADPOOL_FULL;
+    }
+
+    if(__atomic_load_n(&(pool->shutdown), __ATOMIC_RELAXED)) {
+        return THREADPOOL_ERR;
+    }
+    if(threadpool_mpmc_push(queue, task, 1, threadpool_stamp(pool)) == 0) {
+        return THREADPOOL_FULL;
+    }
+    int64_t depth = threadpool_mpmc_depth(queue);
+    threadpool_note_depth(pool, depth);
+    // Any worker will do, idle workers drain every queue
+    threadpool_wake_idle(pool, 1);
+    threadpool_maybe_grow(pool, depth);
+    return THREADPOOL_OK;
+}
+
+// THREADPOOL_OK when the shared queue has a free slot
+static int threadpool_check_room(threadpool_t *pool)
+{
+    if(__atomic_load_n(&(pool->shutdown), __ATOMIC_RELAXED)) {
+        return THREADPOOL_ERR;
+    }
+    if(pool->lfqueue != NULL) {
+        return threadpool_mpmc_depth(pool->lfqueue) <= (int64_t)pool->lfqueue->mask ?
+               THREADPOOL_OK : THREADPOOL_FULL;
+    }
+
+    pthread_mutex_lock(&(pool->lock));
+    bool room = pool->count < pool->queue_size ||
+                (pool->overflow == THREADPOOL_OVERFLOW_GROW && pool->queue_size < pool->max_queue_size);
+    pthread_mutex_unlock(&(pool->lock));
+    return room ? THREADPOOL_OK : THREADPOOL_FULL;
+}
+
+// Retry a full push (or, with task NULL, only wait for room in the shared
+// queue) each time a worker frees a slot, for up to timeout_ms (-1 = forever)
+static int threadpool_space_wait(threadpool_t *pool, const threadpool_task_t *task,
+                                 threadpool_mpmc_t *queue, int timeout_ms)
+{
+    struct timespec deadline;
+    if(timeout_ms >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&(pool->space_lock));
+    __atomic_add_fetch(&(pool->space_waiters), 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    int ret;
+    for(;;) {
+        ret = task ? threadpool_try_push(pool, task, queue) : threadpool_check_room(pool);
+        if(ret != THREADPOOL_FULL) {
+            break;
+        }
+
+        // Sleep until notified, the next recheck or the deadline, whichever is first
+        struct timespec wake;
+        clock_gettime(CLOCK_MONOTONIC, &wake);
+        wake.tv_nsec += THREADPOOL_SPACE_RECHECK_MS * 1000000L;
+        if(wake.tv_nsec >= 1000000000L) {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000L;
+        }
+        bool last = timeout_ms >= 0 &&
+                    (deadline.tv_sec < wake.tv_sec ||
+                     (deadline.tv_sec == wake.tv_sec && deadline.tv_nsec <= wake.tv_nsec));
+        if(pthread_cond_timedwait(&(pool->space), &(pool->space_lock), last ? &deadline : &wake) == ETIMEDOUT &&
+           last) {
+            ret = task ? threadpool_try_push(pool, task, queue) : threadpool_check_room(pool);
+            break;
+        }
+    }
+
+    __atomic_sub_fetch(&(pool->space_waiters), 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&(pool->space_lock));
+    return ret;
+}
+
+// Apply the overflow policy to a task that found its queue full.
+// Growing has already been tried by the shared queue itself.
+static int threadpool_overflow(threadpool_t *pool, const threadpool_task_t *task, threadpool_mpmc_t *queue)
+{
+    threadpool_worker_t *self = current_worker;
+    if(self != NULL && self->pool != pool) {
+        self = NULL;
+    }
+
+    int policy = pool->overflow;
+    // A worker waiting for its own pool to drain could wait forever
+    if(policy == THREADPOOL_OVERFLOW_BLOCK && current_pool == pool) {
+        policy = THREADPOOL_OVERFLOW_CALLER_RUNS;
+    }
+
+    if(policy == THREADPOOL_OVERFLOW_CALLER_RUNS) {
+        if(__atomic_load_n(&(pool->shutdown), __ATOMIC_RELAXED)) {
+            return THREADPOOL_ERR;
+        }
+        threadpool_task_t copy = *task;
+        copy.enqueue_ns = 0;
+        threadpool_run_task(pool, self, &copy);
+        return THREADPOOL_OK;
+    }
+    if(policy == THREADPOOL_OVERFLOW_BLOCK) {
+        return threadpool_space_wait(pool, task, queue, pool->block_timeout_ms);
+    }
+    return THREADPOOL_FULL;
+}
+
+// Place a task on the caller's node queue or the shared queue, both FIFO,
+// without applying the overflow policy
+static int threadpool_try_add_shared(threadpool_t *pool, const threadpool_task_t *task)
+{
+    // Tasks added from a worker of a NUMA pool stay on its node when possible
+    if(threadpool_push_node(pool, task, 1) == 1) {
+        return THREADPOOL_OK;
+    }
+
+    return threadpool_try_push(pool, task, NULL);
+}
+
+// Place a task on the caller's deque, its node's queue or the shared queue,
+// without applying the overflow policy
+static int threadpool_try_add(threadpool_t *pool, const threadpool_task_t *task)
+{
+    if(threadpool_push_local(pool, task, 1) == 1) {
+        return THREADPOOL_OK;
+    }
+    return threadpool_try_add_shared(pool, task);
+}
+
+int threadpool_add(threadpool_t *pool, void (*function)(void *), void *argument)
+{
+    if(pool == NULL || function == NULL) {
+        return THREADPOOL_ERR;
+    }
+
+    threadpool_task_t task = { function, argument, 0 };
+    int ret = threadpool_try_add(pool, &task);
+    if(ret == THREADPOOL_FULL) {
+        ret = threadpool_overflow(pool, &task, NULL);
+    }
+    if(ret == THREADPOOL_FULL) {
+        threadpool_note_rejected(pool, 1);
+    }
+    return ret;
+}
+
+int threadpool_wait_capacity(threadpool_t *pool, int timeout_ms)
+{
+    if(pool == NULL) {
+        return THREADPOOL_ERR;
+    }
+    return threadpool_space_wait(pool, NULL, NULL, timeout_ms);
+}
+
+// Task with a deadline, checked when a worker picks it up
+typedef struct {
+    void (*function)(void *);
+    void *argument;
+    void (*expired)(void *);
+    int64_t deadline_ns;
+} threadpool_deadline_task_t;
+
+static void threadpool_deadline_run(void *argument)
+{
+    threadpool_deadline_task_t task = *(threadpool_deadline_task_t *)argument;
+    free(argument);
+
+    if(threadpool_clock_ns() > task.deadline_ns) {
+        if(task.expired != NULL) {
+            (*(task.expired))(task.argument);
+        }
+        return;
+    }
+    (*(task.function))(task.argument);
+}
+
+int threadpool_add_ex(threadpool_t *pool, void (*function)(void *), void *argument,
+                      const threadpool_task_opts_t *opts)
+{
+    if(pool == NULL || function == NULL) {
+        return THREADPOOL_ERR;
+    }
+    if(opts == NULL) {
+        return threadpool_add(pool, function, argument);
+    }
+    if(opts->priority < 0 || opts->priority >= THREADPOOL_PRIORITY_COUNT) {
+        return THREADPOOL_ERR;
+    }
+
+    threadpool_task_t task = { function, argument, 0 };
+    threadpool_deadline_task_t *wrapped = NULL;
+    if(opts->deadline_ns > 0) {
+        wrapped = (threadpool_deadline_task_t *)malloc(sizeof(threadpool_deadline_task_t));
+        if(wrapped == NULL) {
+            return THREADPOOL_ERR;
+        }
+        wrapped->function = function;
+        wrapped->argument = argument;
+        wrapped->expired = opts->expired;
+        wrapped->deadline_ns = opts->deadline_ns;
+        task.function = threadpool_deadline_run;
+        task.argument = wrapped;
+    }
+
+    int ret;
+    threadpool_mpmc_t *queue = pool->class_queues[opts->priority];
+    if(queue == NULL) {
+        ret = threadpool_add(pool, task.function, task.argument);
+    } else {
+        ret = threadpool_try_push(pool, &task, queue);
+        if(ret == THREADPOOL_FULL) {
+            ret = threadpool_overflow(pool, &task, queue);
+        }
+        if(ret == THREADPOOL_FULL) {
+            threadpool_note_rejected(pool, 1);
+        }
+    }
+
+    if(ret != THREADPOOL_OK) {
+        free(wrapped);
+    }
+    return ret;
+}
+
+int threadpool_add_node(threadpool_t *pool, int node, void (*function)(void *), void *argument)
+{
+    if(pool == NULL || function == NULL || node < 0 || node >= pool->node_count) {
+        return THREADPOOL_ERR;
+    }
+
+    threadpool_task_t task = { function, argument, 0 };
+    threadpool_mpmc_t *queue = &(pool->nodes[node].queue);
+    int ret = threadpool_try_push(pool, &task, queue);
+    if(ret == THREADPOOL_FULL) {
+        ret = threadpool_overflow(pool, &task, queue);
+    }
+    if(ret == THREADPOOL_FULL) {
+        threadpool_note_rejected(pool, 1);
+    }
+    return ret;
+}
+
+int threadpool_node_count(threadpool_t *pool)
+{
+    return pool ? pool->node_count : 0;
+}
+
+int threadpool_current_node(threadpool_t *pool)
+{
+    threadpool_worker_t *worker = current_worker;
+    if(worker == NULL || worker->pool != pool) {
+        return -1;
+    }
+    return worker->node;
+}
+
+int threadpool_add_batch(threadpool_t *pool, const threadpool_task_t *tasks, int count)
+{
+    if(pool == NULL || count < 0 || (count > 0 && tasks == NULL)) {
+        return THREADPOOL_ERR;
+    }
+    for(int i = 0; i < count; i++) {
+        if(tasks[i].function == NULL) {
+            return THREADPOOL_ERR;
+        }
+    }
+    if(count == 0) {
+        return 0;
+    }
+
+    // Same placement as single submissions: the caller's deque, its node's
+    // queue, then the shared queue
+    int added = threadpool_push_local(pool, tasks, count);
+    if(added < count) {
+        added += threadpool_push_node(pool, tasks + added, count - added);
+    }
+    if(added == count) {
+        return added;
+    }
+
+    int ret = threadpool_enqueue_shared(pool, tasks + added, count - added);
+    if(ret < 0) {
+        return added > 0 ? added : ret;
+    }
+    added += ret;
+
+    // What did not fit goes through the overflow policy one task at a time
+    while(added < count && pool->overflow != THREADPOOL_OVERFLOW_REJECT &&
+          threadpool_overflow(pool, &(tasks[added]), NULL) == THREADPOOL_OK) {
+        added++;
+    }
+    threadpool_note_rejected(pool, count - added);
+    return added;
+}
+
+int threadpool_waitgroup_init(threadpool_waitgroup_t *wg)
+{
+    if(wg == NULL) {
+        return THREADPOOL_ERR;
+    }
+
+    wg->pending = 0;
+    wg->waiters = 0;
+    wg->fibers = NULL;
+    if(pthread_mutex_init(&(wg->lock), NULL) != 0) {
+        return THREADPOOL_ERR;
+    }
+    if(pthread_cond_init(&(wg->done), NULL) != 0) {
+        pthread_mutex_destroy(&(wg->lock));
+        return THREADPOOL_ERR;
+    }
+    return THREADPOOL_OK;
+}
+
+void threadpool_waitgroup_destroy(threadpool_waitgroup_t *wg)
+{
+    if(wg == NULL) {
+        return;
+    }
+
+    // The last threadpool_waitgroup_done() may still be unlocking
+    pthread_mutex_lock(&(wg->lock));
+    pthread_mutex_unlock(&(wg->lock));
+
+    pthread_mutex_destroy(&(wg->lock));
+    pthread_cond_destroy(&(wg->done));
+}
+
+void threadpool_waitgroup_add(threadpool_waitgroup_t *wg, int count)
+{
+    __atomic_add_fetch(&(wg->pending), count, __ATOMIC_RELAXED);
+}
+
+void threadpool_waitgroup_done(threadpool_waitgroup_t *wg)
+{
+    // All but the last task leave without touching the lock
+    int pending = __atomic_load_n(&(wg->pending), __ATOMIC_RELAXED);
+    while(pending > 1) {
+        if(__atomic_compare_exchange_n(&(wg->pending), &pending, pending - 1, true,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+
+    // The last one drops to zero under the lock, so a waiter that returns
+    // (and may free wg) has seen this critical section finish
+    threadpool_fiber_t *fibers = NULL;
+    pthread_mutex_lock(&(wg->lock));
+    if(__atomic_sub_fetch(&(wg->pending), 1, __ATOMIC_ACQ_REL) == 0) {
+        if(wg->waiters > 0) {
+            pthread_cond_broadcast(&(wg->done));
+        }
+        fibers = wg->fibers;
+        wg->fibers = NULL;
+    }
+    pthread_mutex_unlock(&(wg->lock));
+
+    while(fibers != NULL) {
+        threadpool_fiber_t *next = fibers->next;
+        threadpool_fiber_wake(fibers);
+        fibers = next;
+    }
+}
+
+// Park callback of a fiber waiting on a wait-group
+static void threadpool_waitgroup_park(threadpool_fiber_t *fiber, void *ctx)
+{
+    threadpool_waitgroup_t *wg = (threadpool_waitgroup_t *)ctx;
+
+    pthread_mutex_lock(&(wg->lock));
+    if(__atomic_load_n(&(wg->pending), __ATOMIC_ACQUIRE) > 0) {
+        fiber->next = wg->fibers;
+        wg->fibers = fiber;
+        fiber = NULL;
+    }
+    pthread_mutex_unlock(&(wg->lock));
+
+    // Done before we got here
+    if(fiber != NULL) {
+        threadpool_fiber_wake(fiber);
+    }
+}
+
+void threadpool_waitgroup_wait(threadpool_t *pool, threadpool_waitgroup_t *wg)
+{
+    // Fibers give their worker back instead of helping on a small stack
+    if(current_fiber != NULL) {
+        while(__atomic_load_n(&(wg->pending), __ATOMIC_ACQUIRE) > 0) {
+            threadpool_fiber_park(threadpool_waitgroup_park, wg);
+        }
+        return;
+    }
+
+    // Help with queued tasks while ours are outstanding
+    while(__atomic_load_n(&(wg->pending), __ATOMIC_ACQUIRE) > 0) {
+        if(!threadpool_run_one(pool)) {
+            break;
+        }
+    }
+
+    // Nothing left to help with, the remaining tasks are running elsewhere
+    pthread_mutex_lock(&(wg->lock));
+    wg->waiters++;
+    while(__atomic_load_n(&(wg->pending), __ATOMIC_ACQUIRE) > 0) {
+        pthread_cond_wait(&(wg->done), &(wg->lock));
+    }
+    wg->waiters--;
+    pthread_mutex_unlock(&(wg->lock));
+}
+
+static void threadpool_future_run(void *argument)
+{
+    threadpool_future_t *future = (threadpool_future_t *)argument;
+    future->result = (*(future->function))(future->argument);
+    threadpool_waitgroup_done(&(future->wg));
+}
+
+threadpool_future_t *threadpool_submit(threadpool_t *pool, void *(*function)(void *), void *argument)
+{
+    if(pool == NULL || function == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    threadpool_future_t *future = (threadpool_future_t *)malloc(sizeof(threadpool_future_t));
+    if(future == NULL) {
+        return NULL;
+    }
+    if(threadpool_waitgroup_init(&(future->wg)) != THREADPOOL_OK) {
+        free(future);
+        errno = ENOMEM;
+        return NULL;
+    }
+    future->function = function;
+    future->argument = argument;
+    future->result = NULL;
+    threadpool_waitgroup_add(&(future->wg), 1);
+
+    int ret = threadpool_add(pool, threadpool_future_run, future);
+    if(ret != THREADPOOL_OK) {
+        threadpool_waitgroup_destroy(&(future->wg));
+        free(future);
+        errno = (ret == THREADPOOL_FULL) ? EAGAIN : EINVAL;
+        return NULL;
+    }
+    return future;
+}
+
+bool threadpool_future_ready(threadpool_future_t *future)
+{
+    return __atomic_load_n(&(future->wg.pending), __ATOMIC_ACQUIRE) == 0;
+}
+
+void *threadpool_future_get(threadpool_t *pool, threadpool_future_t *future)
+{
+    threadpool_waitgroup_wait(pool, &(future->wg));
+    return future->result;
+}
+
+void threadpool_future_destroy(threadpool_future_t *future)
+{
+    if(future == NULL) {
+        return;
+    }
+    threadpool_waitgroup_destroy(&(future->wg));
+    free(future);
+}
+
+static threadpool_fiber_t *threadpool_fiber_alloc(threadpool_t *pool)
+{
+    pthread_mutex_lock(&(pool->fiber_lock));
+    threadpool_fiber_t *fiber = pool->fiber_cache;
+    if(fiber != NULL) {
+        pool->fiber_cache = fiber->next;
+        pool->fiber_cached--;
+    }
+    pthread_mutex_unlock(&(pool->fiber_lock));
+    if(fiber != NULL) {
+        return fiber;
+    }
+
+    fiber = (threadpool_fiber_t *)malloc(sizeof(threadpool_fiber_t));
+    if(fiber == NULL) {
+        return NULL;
+    }
+
+    // A PROT_NONE page below the stack turns an overflow into a fault
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    fiber->map_size = pool->fiber_stack_size + page;
+    fiber->stack = (char *)mmap(NULL, fiber->map_size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if(fiber->stack == MAP_FAILED) {
+        free(fiber);
+        return NULL;
+    }
+    mprotect(fiber->stack, page, PROT_NONE);
+    fiber->pool = pool;
+    return fiber;
+}
+
+static void threadpool_fiber_free(threadpool_fiber_t *fiber)
+{
+    munmap(fiber->stack, fiber->map_size);
+    free(fiber);
+}
+
+static void threadpool_fiber_release(threadpool_t *pool, threadpool_fiber_t *fiber)
+{
+    pthread_mutex_lock(&(pool->fiber_lock));
+    if(pool->fiber_cached < THREADPOOL_FIBER_CACHE) {
+        fiber->next = pool->fiber_cache;
+        pool->fiber_cache = fiber;
+        pool->fiber_cached++;
+        fiber = NULL;
+    }
+    pthread_mutex_unlock(&(pool->fiber_lock));
+
+    if(fiber != NULL) {
+        threadpool_fiber_free(fiber);
+    }
+}
+
+// Entry point on the fiber's own stack
+static void threadpool_fiber_main(void)
+{
+    threadpool_fiber_t *fiber = current_fiber;
+    (*(fiber->function))(fiber->argument);
+
+    // May be on another thread by now, so only fiber fields from here on
+    fiber->state = THREADPOOL_FIBER_DONE;
+    setcontext(fiber->caller);
+}
+
+// Switch from the fiber back to the thread running it. Kept out of line so
+// no thread-local address is cached across the switch, the fiber may come
+// back on another thread.
+static __attribute__((noinline)) void threadpool_fiber_switch(threadpool_fiber_t *fiber, int state)
+{
+    fiber->state = state;
+    swapcontext(&(fiber->context), fiber->caller);
+}
+
+// Task that runs a fiber until it yields, parks or finishes
+static void threadpool_fiber_run(void *argument)
+{
+    threadpool_fiber_t *fiber = (threadpool_fiber_t *)argument;
+    threadpool_t *pool = fiber->pool;
+    // A fiber woken inline may run on top of another one
+    threadpool_fiber_t *outer = current_fiber;
+    ucontext_t caller;
+
+    for(;;) {
+        fiber->caller = &caller;
+        fiber->state = THREADPOOL_FIBER_RUNNING;
+        current_fiber = fiber;
+        swapcontext(&caller, &(fiber->context));
+        current_fiber = outer;
+
+        if(fiber->state == THREADPOOL_FIBER_YIELDED) {
+            // Behind whatever is queued, or straight back in when the queue is
+            // full. Never on the deque, the worker would pop it right back.
+            threadpool_task_t task = { threadpool_fiber_run, fiber, 0 };
+            if(threadpool_try_add_shared(pool, &task) == THREADPOOL_OK) {
+                return;
+            }
+            continue;
+        }
+
+        if(fiber->state == THREADPOOL_FIBER_PARKED) {
+            (*(fiber->park))(fiber, fiber->park_ctx);
+            return;
+        }
+
+        threadpool_fiber_release(pool, fiber);
+        return;
+    }
+}
+
+// Point the fiber's context at threadpool_fiber_main on its own stack. Out
+// of line so getcontext() returning twice cannot clobber the caller's locals.
+static __attribute__((noinline)) int threadpool_fiber_prepare(threadpool_fiber_t *fiber, size_t stack_size)
+{
+    if(getcontext(&(fiber->context)) != 0) {
+        return THREADPOOL_ERR;
+    }
+    fiber->context.uc_stack.ss_sp = fiber->stack + (fiber->map_size - stack_size);
+    fiber->context.uc_stack.ss_size = stack_size;
+    fiber->context.uc_link = NULL;
+    makecontext(&(fiber->context), threadpool_fiber_main, 0);
+    return THREADPOOL_OK;
+}
+
+int threadpool_fiber_spawn(threadpool_t *pool, void (*function)(void *), void *argument)
+{
+    if(pool == NULL || function == NULL) {
+        return THREADPOOL_ERR;
+    }
+
+    threadpool_fiber_t *fiber = threadpool_fiber_alloc(pool);
+    if(fiber == NULL) {
+        return THREADPOOL_ERR;
+    }
+
+    if(threadpool_fiber_prepare(fiber, pool->fiber_stack_size) != THREADPOOL_OK) {
+        threadpool_fiber_release(pool, fiber);
+        return THREADPOOL_ERR;
+    }
+    fiber->function = function;
+    fiber->argument = argument;
+    fiber->next = NULL;
+
+    int ret = threadpool_add(pool, threadpool_fiber_run, fiber);
+    if(ret != THREADPOOL_OK) {
+        threadpool_fiber_release(pool, fiber);
+    }
+    return ret;
+}
+
+threadpool_fiber_t *threadpool_fiber_self(void)
+{
+    return current_fiber;
+}
+
+void threadpool_fiber_yield(void)
+{
+    threadpool_fiber_t *fiber = current_fiber;
+    if(fiber == NULL) {
+        sched_yield();
+        return;
+    }
+    threadpool_fiber_switch(fiber, THREADPOOL_FIBER_YIELDED);
+}
+
+int threadpool_fiber_park(void (*park)(threadpool_fiber_t *, void *), void *ctx)
+{
+    threadpool_fiber_t *fiber = current_fiber;
+    if(fiber == NULL || park == NULL) {
+        return THREADPOOL_ERR;
+    }
+
+    fiber->park = park;
+    fiber->park_ctx = ctx;
+    threadpool_fiber_switch(fiber, THREADPOOL_FIBER_PARKED);
+    return THREADPOOL_OK;
+}
+
+void threadpool_fiber_wake(threadpool_fiber_t *fiber)
+{
+    // Queued without the overflow policy, a parked fiber must never be lost,
+    // so it runs on the waking thread when the queue is full
+    threadpool_task_t task = { threadpool_fiber_run, fiber, 0 };
+    if(threadpool_try_add(fiber->pool, &task) != THREADPOOL_OK) {
+        threadpool_fiber_run(fiber);
+    }
+}
+
+static void threadpool_timer_unlink(threadpool_timer_t *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+static void threadpool_timer_put(threadpool_timer_t *timer)
+{
+    if(--timer->refs == 0) {
+        free(timer);
+    }
+}
+
+// Link a timer into the slot for its expiry, timer_lock held. Timers beyond
+// the wheel's range go to the last slot and are placed again on cascade.
+static void threadpool_wheel_insert(threadpool_t *pool, threadpool_timer_t *timer)
+{
+    uint64_t now = pool->timer_tick;
+    uint64_t expires = (timer->expires > now) ? timer->expires : now;
+    uint64_t delta = expires - now;
+    threadpool_timer_t *head;
+
+    if(delta < THREADPOOL_WHEEL_ROOT) {
+        head = &(pool->wheel[expires & (THREADPOOL_WHEEL_ROOT - 1)]);
+    } else {
+        int level = 1;
+        int shift = THREADPOOL_WHEEL_ROOT_BITS + THREADPOOL_WHEEL_BITS;
+        while(level < THREADPOOL_WHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << shift)) {
+            level++;
+            shift += THREADPOOL_WHEEL_BITS;
+        }
+        if(delta >= ((uint64_t)1 << shift)) {
+            expires = now + ((uint64_t)1 << shift) - 1;
+        }
+        int index = (int)((expires >> (shift - THREADPOOL_WHEEL_BITS)) & (THREADPOOL_WHEEL_SIZE - 1));
+        head = &(pool->wheel[THREADPOOL_WHEEL_ROOT + (level - 1) * THREADPOOL_WHEEL_SIZE + index]);
+    }
+
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+// Move the current slot of a level down the wheel, returns its index
+static int threadpool_wheel_cascade(threadpool_t *pool, int level)
+{
+    int shift = THREADPOOL_WHEEL_ROOT_BITS + (level - 1) * THREADPOOL_WHEEL_BITS;
+    int index = (int)((pool->timer_tick >> shift) & (THREADPOOL_WHEEL_SIZE - 1));
+    threadpool_timer_t *head = &(pool->wheel[THREADPOOL_WHEEL_ROOT + (level - 1) * THREADPOOL_WHEEL_SIZE + index]);
+
+    while(head->next != head) {
+        threadpool_timer_t *timer = head->next;
+        threadpool_timer_unlink(timer);
+        threadpool_wheel_insert(pool, timer);
+    }
+    return index;
+}
+
+// Process one tick, appending its timers to the due list
+static void threadpool_wheel_tick(threadpool_t *pool, threadpool_timer_t *due)
+{
+    int index = (int)(pool->timer_tick & (THREADPOOL_WHEEL_ROOT - 1));
+    if(index == 0) {
+        for(int level = 1; level < THREADPOOL_WHEEL_LEVELS && threadpool_wheel_cascade(pool, level) == 0; level++) {
+        }
+    }
+
+    threadpool_timer_t *head = &(pool->wheel[index]);
+    if(head->next != head) {
+        head->next->prev = due->prev;
+        due->prev->next = head->next;
+        head->prev->next = due;
+        due->prev = head->prev;
+        head->next = head;
+        head->prev = head;
+    }
+    pool->timer_tick++;
+}
+
+// Next tick with timers in its root slot, or the next cascade
+static uint64_t threadpool_wheel_next(threadpool_t *pool)
+{
+    uint64_t tick = pool->timer_tick;
+    for(;;) {
+        int index = (int)(tick & (THREADPOOL_WHEEL_ROOT - 1));
+        if(index == 0 || pool->wheel[index].next != &(pool->wheel[index])) {
+            return tick;
+        }
+        tick++;
+    }
+}
+
+static void *threadpool_timer_thread(void *arg)
+{
+    threadpool_t *pool = (threadpool_t *)arg;
+    threadpool_timer_t due;
+    due.next = &due;
+    due.prev = &due;
+    // Firings taken off the due list but not yet queued
+    threadpool_task_t batch[THREADPOOL_TIMER_BATCH];
+    int count = 0;
+
+    pthread_mutex_lock(&(pool->timer_lock));
+    while(!pool->timer_stop) {
+        uint64_t now = (uint64_t)(threadpool_clock_ns() - pool->timer_base) / THREADPOOL_TICK_NS;
+        while(pool->timer_tick <= now) {
+            threadpool_wheel_tick(pool, &due);
+        }
+
+        // Queue due tasks in batches outside the lock, periodic timers rearm.
+        // Firings bypass the overflow policy: what finds the queue full is
+        // neither dropped nor waited for, it is retried on the next tick.
+        // The batch is only refilled once it has drained, so a periodic
+        // timer waits in the due list rather than piling up firings.
+        for(;;) {
+            bool refill = (count == 0);
+            while(refill && count < THREADPOOL_TIMER_BATCH && due.next != &due) {
+                threadpool_timer_t *timer = due.next;
+                threadpool_timer_unlink(timer);
+                batch[count].function = timer->function;
+                batch[count].argument = timer->argument;
+                batch[count].enqueue_ns = 0;
+                count++;
+                if(timer->period > 0) {
+                    // A timer that fell behind skips the firings it missed
+                    // instead of firing on every tick until it catches up
+                    timer->expires += timer->period;
+                    if(timer->expires < pool->timer_tick) {
+                        uint64_t behind = pool->timer_tick - timer->expires;
+                        timer->expires += (behind + timer->period - 1) / timer->period * timer->period;
+                    }
+                    threadpool_wheel_insert(pool, timer);
+                } else {
+                    pool->timer_count--;
+                    threadpool_timer_put(timer);
+                }
+            }
+            if(count == 0) {
+                break;
+            }
+
+            pthread_mutex_unlock(&(pool->timer_lock));
+            int added = threadpool_enqueue_shared(pool, batch, count);
+            pthread_mutex_lock(&(pool->timer_lock));
+
+            // A closing pool takes no more tasks
+            if(added < 0) {
+                added = count;
+            }
+            count -= added;
+            memmove(batch, batch + added, sizeof(threadpool_task_t) * count);
+            if(count > 0) {
+                break;
+            }
+        }
+        if(pool->timer_stop) {
+            break;
+        }
+
+        // Sleep until something can be due, or one tick while firings wait
+        // for room in the queue
+        if(pool->timer_count == 0 && count == 0) {
+            pool->timer_next = UINT64_MAX;
+            pthread_cond_wait(&(pool->timer_wake), &(pool->timer_lock));
+        } else {
+            pool->timer_next = (count > 0) ? pool->timer_tick : threadpool_wheel_next(pool);
+            int64_t wake = pool->timer_base + (int64_t)pool->timer_next * THREADPOOL_TICK_NS;
+            struct timespec deadline;
+            deadline.tv_sec = wake / 1000000000L;
+            deadline.tv_nsec = wake % 1000000000L;
+            pthread_cond_timedwait(&(pool->timer_wake), &(pool->timer_lock), &deadline);
+        }
+    }
+    pthread_mutex_unlock(&(pool->timer_lock));
+    return NULL;
+}
+
+static int threadpool_add_timer(threadpool_t *pool, int64_t delay_ms, int64_t period_ms,
+                                void (*function)(void *), void *argument, threadpool_timer_t **handle)
+{
+    if(pool == NULL || function == NULL || delay_ms < 0 ||
+       __atomic_load_n(&(pool->shutdown), __ATOMIC_RELAXED)) {
+        return THREADPOOL_ERR;
+    }
+
+    threadpool_timer_t *timer = (threadpool_timer_t *)malloc(sizeof(threadpool_timer_t));
+    if(timer == NULL) {
+        return THREADPOOL_ERR;
+    }
+    timer->function = function;
+    timer->argument = argument;
+    timer->period = (uint64_t)period_ms;
+    timer->refs = handle ? 2 : 1;
+
+    pthread_mutex_lock(&(pool->timer_lock));
+
+    // The wheel and its thread come with the first timer
+    if(pool->wheel == NULL) {
+        pool->wheel = (threadpool_timer_t *)malloc(sizeof(threadpool_timer_t) * THREADPOOL_WHEEL_SLOTS);
+        if(pool->wheel == NULL) {
+            pthread_mutex_unlock(&(pool->timer_lock));
+            free(timer);
+            return THREADPOOL_ERR;
+        }
+        for(int i = 0; i < THREADPOOL_WHEEL_SLOTS; i++) {
+            pool->wheel[i].next = &(pool->wheel[i]);
+            pool->wheel[i].prev = &(pool->wheel[i]);
+        }
+        pool->timer_base = threadpool_clock_ns();
+        pool->timer_tick = 0;
+    }
+    if(!pool->timer_started) {
+        if(pthread_create(&(pool->timer_thread), NULL, threadpool_timer_thread, pool) != 0) {
+            pthread_mutex_unlock(&(pool->timer_lock));
+            free(timer);
+            return THREADPOOL_ERR;
+        }
+        pool->timer_started = true;
+    }
+
+    // Round up so a timer never fires early. An empty wheel skips straight
+    // to the current tick instead of the timer thread catching up.
+    int64_t now_ns = threadpool_clock_ns() - pool->timer_base;
+    if(pool->timer_count == 0) {
+        pool->timer_tick = (uint64_t)now_ns / THREADPOOL_TICK_NS;
+    }
+    int64_t due_ns = now_ns + delay_ms * 1000000;
+    timer->expires = (uint64_t)((due_ns + THREADPOOL_TICK_NS - 1) / THREADPOOL_TICK_NS);
+    threadpool_wheel_insert(pool, timer);
+    pool->timer_count++;
+    if(timer->expires < pool->timer_next) {
+        pthread_cond_signal(&(pool->timer_wake));
+    }
+    pthread_mutex_unlock(&(pool->timer_lock));
+
+    if(handle != NULL) {
+        *handle = timer;
+    }
+    return THREADPOOL_OK;
+}
+
+int threadpool_add_delayed(threadpool_t *pool, int64_t delay_ms, void (*function)(void *), void *argument,
+                           threadpool_timer_t **timer)
+{
+    return threadpool_add_timer(pool, delay_ms, 0, function, argument, timer);
+}
 
-    for(;;) {
-        pthread_mutex_lock(&(pool->lock));
+int threadpool_add_periodic(threadpool_t *pool, int64_t period_ms, void (*function)(void *), void *argument,
+                            threadpool_timer_t **timer)
+{
+    if(period_ms <= 0) {
+        return THREADPOOL_ERR;
+    }
+    return threadpool_add_timer(pool, period_ms, period_ms, function, argument, timer);
+}
 
-        // Wait for the task or close the notification
-        while(pool->count == 0 && !pool->shutdown) {
-            pthread_cond_wait(&(pool->notify), &(pool->lock));
+int threadpool_timer_cancel(threadpool_t *pool, threadpool_timer_t *timer)
+{
+    if(pool == NULL || timer == NULL) {
+        return THREADPOOL_ERR;
+    }
+
+    int ret = THREADPOOL_ERR;
+    pthread_mutex_lock(&(pool->timer_lock));
+    if(timer->next != NULL) {
+        // The wheel's reference, the handle still holds one
+        threadpool_timer_unlink(timer);
+        pool->timer_count--;
+        timer->refs--;
+        ret = THREADPOOL_OK;
+    }
+    threadpool_timer_put(timer);
+    pthread_mutex_unlock(&(pool->timer_lock));
+    return ret;
+}
+
+// Shared state of one parallel_for / parallel_reduce call
+typedef struct {
+    threadpool_t *pool;
+    int64_t grain;
+    void (*for_fn)(int64_t, int64_t, void *);
+    void (*reduce_fn)(int64_t, int64_t, void *, void *);
+    void (*join)(void *, const void *, void *);
+    void *ctx;
+    void *result;             // Caller's accumulator
+    const void *identity;     // Initial value of result, copied into each piece
+    size_t result_size;
+    pthread_mutex_t lock;     // Serializes joins into result
+    threadpool_waitgroup_t wg;
+} threadpool_range_job_t;
+
+typedef struct {
+    threadpool_range_job_t *job;
+    int64_t begin;
+    int64_t end;
+    // result_size bytes of accumulator for reductions, aligned for any type
+    max_align_t result[];
+} threadpool_range_piece_t;
+
+// Lazy binary splitting: only split when idle threads could take the other
+// half, i.e. the place a thief or idle worker looks for tasks is empty
+static bool threadpool_wants_work(threadpool_t *pool)
+{
+    threadpool_worker_t *self = current_worker;
+    if(self != NULL && self->pool == pool && (pool->flags & THREADPOOL_WORK_STEALING)) {
+        return __atomic_load_n(&(self->deque.bottom), __ATOMIC_RELAXED) <=
+               __atomic_load_n(&(self->deque.top), __ATOMIC_RELAXED);
+    }
+    return !threadpool_shared_busy(pool);
+}
+
+static void threadpool_range_piece_run(void *argument);
+
+// Hand [begin, end) to the pool as a new piece. Returns false when it has
+// to be run here instead.
+static bool threadpool_range_spawn(threadpool_range_job_t *job, int64_t begin, int64_t end)
+{
+    size_t size = sizeof(threadpool_range_piece_t) + (job->reduce_fn ? job->result_size : 0);
+    threadpool_range_piece_t *piece = (threadpool_range_piece_t *)malloc(size);
+    if(piece == NULL) {
+        return false;
+    }
+    piece->job = job;
+    piece->begin = begin;
+    piece->end = end;
+    if(job->reduce_fn) {
+        memcpy(piece->result, job->identity, job->result_size);
+    }
+
+    threadpool_waitgroup_add(&(job->wg), 1);
+    // Never block or run inline here, a full queue just means no split
+    threadpool_task_t task = { threadpool_range_piece_run, piece, 0 };
+    if(threadpool_try_add(job->pool, &task) != THREADPOOL_OK) {
+        threadpool_waitgroup_done(&(job->wg));
+        free(piece);
+        return false;
+    }
+    return true;
+}
+
+// Process [begin, end) in grain-sized chunks, splitting off the upper half
+// whenever there is demand for work
+static void threadpool_range_run(threadpool_range_job_t *job, int64_t begin, int64_t end, void *acc)
+{
+    while(end - begin > job->grain) {
+        if(end - begin >= 2 * job->grain && threadpool_wants_work(job->pool)) {
+            int64_t mid = begin + (end - begin) / 2;
+            if(threadpool_range_spawn(job, mid, end)) {
+                end = mid;
+                continue;
+            }
         }
 
-        // Close immediately
-        if(pool->shutdown == 1) {
-            break;
+        if(job->reduce_fn) {
+            job->reduce_fn(begin, begin + job->grain, acc, job->ctx);
+        } else {
+            job->for_fn(begin, begin + job->grain, job->ctx);
         }
+        begin += job->grain;
+    }
 
-        // Close after completing the remaining tasks
-        if(pool->shutdown == 2 && pool->count == 0) {
-            break;
+    if(job->reduce_fn) {
+        job->reduce_fn(begin, end, acc, job->ctx);
+    } else {
+        job->for_fn(begin, end, job->ctx);
+    }
+}
+
+static void threadpool_range_piece_run(void *argument)
+{
+    threadpool_range_piece_t *piece = (threadpool_range_piece_t *)argument;
+    threadpool_range_job_t *job = piece->job;
+
+    threadpool_range_run(job, piece->begin, piece->end, piece->result);
+    if(job->reduce_fn) {
+        pthread_mutex_lock(&(job->lock));
+        job->join(job->result, piece->result, job->ctx);
+        pthread_mutex_unlock(&(job->lock));
+    }
+
+    free(piece);
+    threadpool_waitgroup_done(&(job->wg));
+}
+
+static int threadpool_range_execute(threadpool_range_job_t *job, int64_t begin, int64_t end)
+{
+    if(job->grain <= 0) {
+        // About eight chunks per thread
+        int threads = job->pool ? __atomic_load_n(&(job->pool->thread_count), __ATOMIC_RELAXED) + 1 : 1;
+        job->grain = (end - begin) / (8 * threads);
+        if(job->grain < 1) {
+            job->grain = 1;
         }
+    }
 
-        // Obtain the task
-        task.function = pool->queue[pool->head].function;
-        task.argument = pool->queue[pool->head].argument;
-        pool->head = (pool->head + 1) % pool->queue_size;
-        pool->count -= 1;
+    // Without a pool there is nobody to split for
+    if(job->pool == NULL) {
+        job->grain = end - begin;
+        threadpool_range_run(job, begin, end, job->result);
+        return THREADPOOL_OK;
+    }
 
-        pthread_mutex_unlock(&(pool->lock));
+    if(threadpool_waitgroup_init(&(job->wg)) != THREADPOOL_OK) {
+        return THREADPOOL_ERR;
+    }
+    if(pthread_mutex_init(&(job->lock), NULL) != 0) {
+        threadpool_waitgroup_destroy(&(job->wg));
+        return THREADPOOL_ERR;
+    }
 
-        // run the task
-        (*(task.function))(task.argument);
+    // The caller works on the range too, accumulating straight into result,
+    // then helps with whatever pieces are still queued
+    void *acc = job->result;
+    if(job->reduce_fn) {
+        acc = malloc(job->result_size);
+        if(acc == NULL) {
+            pthread_mutex_destroy(&(job->lock));
+            threadpool_waitgroup_destroy(&(job->wg));
+            return THREADPOOL_ERR;
+        }
+        memcpy(acc, job->identity, job->result_size);
     }
 
-    pool->thread_count--;
-    pthread_mutex_unlock(&(pool->lock));
-    pthread_exit(NULL);
-    return NULL;
+    threadpool_range_run(job, begin, end, acc);
+    threadpool_waitgroup_wait(job->pool, &(job->wg));
+
+    if(job->reduce_fn) {
+        job->join(job->result, acc, job->ctx);
+        free(acc);
+    }
+    pthread_mutex_destroy(&(job->lock));
+    threadpool_waitgroup_destroy(&(job->wg));
+    return THREADPOOL_OK;
 }
 
-int threadpool_add(threadpool_t *pool, void (*function)(void *), void *argument)
+int threadpool_parallel_for(threadpool_t *pool, int64_t begin, int64_t end, int64_t grain,
+                            void (*fn)(int64_t, int64_t, void *), void *ctx)
 {
-    if(pool == NULL || function == NULL) {
+    if(fn == NULL || end < begin) {
         return THREADPOOL_ERR;
     }
+    if(begin == end) {
+        return THREADPOOL_OK;
+    }
 
-    if(pthread_mutex_lock(&(pool->lock)) != 0) {
+    threadpool_range_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.pool = pool;
+    job.grain = grain;
+    job.for_fn = fn;
+    job.ctx = ctx;
+    return threadpool_range_execute(&job, begin, end);
+}
+
+int threadpool_parallel_reduce(threadpool_t *pool, int64_t begin, int64_t end, int64_t grain,
+                               void (*fn)(int64_t, int64_t, void *, void *),
+                               void (*join)(void *, const void *, void *),
+                               void *result, size_t result_size, void *ctx)
+{
+    if(fn == NULL || join == NULL || result == NULL || result_size == 0 || end < begin) {
         return THREADPOOL_ERR;
     }
+    if(begin == end) {
+        return THREADPOOL_OK;
+    }
 
-    int next = (pool->tail + 1) % pool->queue_size;
-    
-    // queue is full
-    if(pool->count == pool->queue_size) {
-        pthread_mutex_unlock(&(pool->lock));
-        return THREADPOOL_FULL;
+    // Every piece starts from the value result holds on entry
+    void *identity = malloc(result_size);
+    if(identity == NULL) {
+        return THREADPOOL_ERR;
     }
+    memcpy(identity, result, result_size);
 
-    // closing
-    if(pool->shutdown) {
-        pthread_mutex_unlock(&(pool->lock));
+    threadpool_range_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.pool = pool;
+    job.grain = grain;
+    job.reduce_fn = fn;
+    job.join = join;
+    job.ctx = ctx;
+    job.result = result;
+    job.identity = identity;
+    job.result_size = result_size;
+
+    int ret = threadpool_range_execute(&job, begin, end);
+    free(identity);
+    return ret;
+}
+
+// Parse a kernel list such as "0-3,8,10-11" from path.
+// Returns the number of entries stored in *list, -1 on error.
+static int threadpool_read_list(const char *path, int **list)
+{
+    char buf[4096];
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL) {
+        return -1;
+    }
+    size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[len] = '\0';
+
+    int count = 0;
+    int capacity = 16;
+    int *out = (int *)malloc(sizeof(int) * capacity);
+    if(out == NULL) {
+        return -1;
+    }
+
+    char *p = buf;
+    while(*p >= '0' && *p <= '9') {
+        long first = strtol(p, &p, 10);
+        long last = first;
+        if(*p == '-') {
+            last = strtol(p + 1, &p, 10);
+        }
+        for(long v = first; v <= last; v++) {
+            if(count == capacity) {
+                int *grown = (int *)realloc(out, sizeof(int) * capacity * 2);
+                if(grown == NULL) {
+                    free(out);
+                    return -1;
+                }
+                out = grown;
+                capacity *= 2;
+            }
+            out[count++] = (int)v;
+        }
+        if(*p == ',') {
+            p++;
+        }
+    }
+
+    *list = out;
+    return count;
+}
+
+// Fill pool->nodes from sysfs, keeping only CPUs this process may run on.
+// Without NUMA information the pool gets a single node and no pinning.
+static int threadpool_init_nodes(threadpool_t *pool, int queue_size)
+{
+    cpu_set_t allowed;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_ZERO(&allowed);
+    }
+
+    int *ids = NULL;
+    int id_count = threadpool_read_list(THREADPOOL_NODE_PATH "/online", &ids);
+    if(id_count <= 0) {
+        free(ids);
+        id_count = 0;
+    }
+
+    pool->nodes = (threadpool_node_t *)calloc(id_count > 0 ? id_count : 1, sizeof(threadpool_node_t));
+    if(pool->nodes == NULL) {
+        free(ids);
         return THREADPOOL_ERR;
     }
 
-    // add task to queue
-    pool->queue[pool->tail].function = function;
-    pool->queue[pool->tail].argument = argument;
-    pool->tail = next;
-    pool->count += 1;
+    for(int i = 0; i < id_count; i++) {
+        char path[128];
+        int *cpus = NULL;
+        snprintf(path, sizeof(path), THREADPOOL_NODE_PATH "/node%d/cpulist", ids[i]);
+        int cpu_count = threadpool_read_list(path, &cpus);
 
-    // Notify a waiting queue
-    if(pthread_cond_signal(&(pool->notify)) != 0) {
-        pthread_mutex_unlock(&(pool->lock));
+        threadpool_node_t *node = &(pool->nodes[pool->node_count]);
+        node->id = ids[i];
+        node->cpu_count = 0;
+        for(int c = 0; c < cpu_count; c++) {
+            if(cpus[c] < CPU_SETSIZE && CPU_ISSET(cpus[c], &allowed)) {
+                cpus[node->cpu_count++] = cpus[c];
+            }
+        }
+
+        // Memory-only nodes have nothing to run workers on
+        if(node->cpu_count == 0) {
+            free(cpus);
+            continue;
+        }
+        node->cpus = cpus;
+        pool->node_count++;
+    }
+    free(ids);
+
+    if(pool->node_count == 0) {
+        pool->nodes[0].id = -1;
+        pool->nodes[0].cpus = NULL;
+        pool->nodes[0].cpu_count = 0;
+        pool->node_count = 1;
+    }
+
+    for(int i = 0; i < pool->node_count; i++) {
+        if(threadpool_mpmc_init(&(pool->nodes[i].queue), queue_size, pool->nodes[i].id) != THREADPOOL_OK) {
+            return THREADPOOL_ERR;
+        }
+    }
+    return THREADPOOL_OK;
+}
+
+// Node index owning cpu, -1 when none does
+static int threadpool_node_of_cpu(threadpool_t *pool, int cpu)
+{
+    for(int i = 0; i < pool->node_count; i++) {
+        for(int c = 0; c < pool->nodes[i].cpu_count; c++) {
+            if(pool->nodes[i].cpus[c] == cpu) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+uint64_t threadpool_histogram_percentile(const threadpool_histogram_t *hist, double percentile)
+{
+    if(hist == NULL || hist->count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)hist->count + 0.5);
+    if(rank < 1) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for(int i = 0; i < THREADPOOL_HISTOGRAM_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if(seen >= rank) {
+            uint64_t value = threadpool_histogram_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+int threadpool_get_worker_stats(threadpool_t *pool, int index, threadpool_worker_stats_t *stats)
+{
+    if(pool == NULL || stats == NULL || pool->stats == NULL || index < 0 || index > pool->worker_count) {
         return THREADPOOL_ERR;
     }
 
-    pthread_mutex_unlock(&(pool->lock));
+    threadpool_worker_stats_t *src = &(pool->stats[index]);
+    memset(stats, 0, sizeof(*stats));
+    stats->tasks = __atomic_load_n(&(src->tasks), __ATOMIC_RELAXED);
+    stats->steals = __atomic_load_n(&(src->steals), __ATOMIC_RELAXED);
+    stats->busy_ns = __atomic_load_n(&(src->busy_ns), __ATOMIC_RELAXED);
+    stats->idle_ns = threadpool_idle_total(src, threadpool_clock_ns());
+    stats->idle_since = __atomic_load_n(&(src->idle_since), __ATOMIC_RELAXED);
+    threadpool_histogram_merge(&(stats->wait_ns), &(src->wait_ns));
+    threadpool_histogram_merge(&(stats->run_ns), &(src->run_ns));
+    return THREADPOOL_OK;
+}
+
+int threadpool_get_stats(threadpool_t *pool, threadpool_stats_t *stats)
+{
+    if(pool == NULL || stats == NULL || pool->stats == NULL) {
+        return THREADPOOL_ERR;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->thread_count = __atomic_load_n(&(pool->thread_count), __ATOMIC_RELAXED);
+    stats->idle = __atomic_load_n(&(pool->idle), __ATOMIC_RELAXED);
+    stats->queue_high_water = __atomic_load_n(&(pool->queue_high_water), __ATOMIC_RELAXED);
+    stats->rejected = __atomic_load_n(&(pool->rejected), __ATOMIC_RELAXED);
+
+    stats->queue_depth = threadpool_pending(pool);
+    for(int i = 0; i < pool->node_count; i++) {
+        stats->queue_depth += threadpool_mpmc_depth(&(pool->nodes[i].queue));
+    }
+    for(int i = 0; i < THREADPOOL_PRIORITY_COUNT; i++) {
+        if(pool->class_queues[i] != NULL) {
+            stats->queue_depth += threadpool_mpmc_depth(pool->class_queues[i]);
+        }
+    }
+
+    // Counters are per worker, so a snapshot sums them without stopping anyone
+    int64_t now = threadpool_clock_ns();
+    for(int i = 0; i <= pool->worker_count; i++) {
+        threadpool_worker_stats_t *src = &(pool->stats[i]);
+        stats->completed += __atomic_load_n(&(src->tasks), __ATOMIC_RELAXED);
+        stats->steals += __atomic_load_n(&(src->steals), __ATOMIC_RELAXED);
+        stats->busy_ns += __atomic_load_n(&(src->busy_ns), __ATOMIC_RELAXED);
+        stats->idle_ns += threadpool_idle_total(src, now);
+        threadpool_histogram_merge(&(stats->wait_ns), &(src->wait_ns));
+        threadpool_histogram_merge(&(stats->run_ns), &(src->run_ns));
+    }
     return THREADPOOL_OK;
 }
 
+void threadpool_attr_init(threadpool_attr_t *attr)
+{
+    if(attr != NULL) {
+        attr->flags = 0;
+        attr->min_threads = 0;
+        attr->max_threads = 0;
+        attr->idle_timeout_ms = 10000;
+        attr->spin_count = 0;
+        attr->cpus = NULL;
+        attr->cpu_count = 0;
+        attr->overflow = THREADPOOL_OVERFLOW_REJECT;
+        attr->block_timeout_ms = -1;
+        attr->max_queue_size = 0;
+        attr->fiber_stack_size = 0;
+    }
+}
+
 threadpool_t *threadpool_create(int thread_count, int queue_size)
 {
-    if(thread_count <= 0 || queue_size <= 0) {
+    return threadpool_create_ex(thread_count, queue_size, NULL);
+}
+
+threadpool_t *threadpool_create_ex(int thread_count, int queue_size, const threadpool_attr_t *attr)
+{
+    // A negative idle timeout would retire idle workers as soon as they park
+    if(thread_count <= 0 || queue_size <= 0 || (attr && attr->idle_timeout_ms < 0)) {
         return NULL;
     }
 
@@ -104,29 +2479,181 @@ threadpool_t *threadpool_create(int thread_count, int queue_size)
     pool->queue_size = queue_size;
     pool->head = pool->tail = pool->count = 0;
     pool->shutdown = 0;
+    pool->flags = attr ? attr->flags : 0;
+    pool->idle = 0;
+    pool->workers = NULL;
+    pool->worker_count = 0;
+    pool->queue = NULL;
+    pool->lfqueue = NULL;
+    pool->cpus = NULL;
+    pool->cpu_count = 0;
+    pool->nodes = NULL;
+    pool->node_count = 0;
+    for(int i = 0; i < THREADPOOL_PRIORITY_COUNT; i++) {
+        pool->class_queues[i] = NULL;
+    }
+    pool->stats = NULL;
+    pool->queue_high_water = 0;
+    pool->rejected = 0;
+    pool->overflow = attr ? attr->overflow : THREADPOOL_OVERFLOW_REJECT;
+    pool->block_timeout_ms = attr ? attr->block_timeout_ms : -1;
+    pool->max_queue_size = (attr && attr->max_queue_size > queue_size) ? attr->max_queue_size : queue_size;
+    pool->space_waiters = 0;
+    pool->fiber_cache = NULL;
+    pool->fiber_cached = 0;
+    pool->timer_started = false;
+    pool->timer_stop = false;
+    pool->wheel = NULL;
+    pool->timer_base = 0;
+    pool->timer_tick = 0;
+    pool->timer_next = UINT64_MAX;
+    pool->timer_count = 0;
+    // Usable stack rounded up to whole pages
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t stack_size = (attr && attr->fiber_stack_size > 0) ? attr->fiber_stack_size : THREADPOOL_FIBER_STACK;
+    pool->fiber_stack_size = (stack_size + page - 1) / page * page;
+
+    // thread bounds, 0 means thread_count
+    pool->min_threads = (attr && attr->min_threads > 0) ? attr->min_threads : thread_count;
+    pool->max_threads = (attr && attr->max_threads > 0) ? attr->max_threads : thread_count;
+    pool->idle_timeout_ms = attr ? attr->idle_timeout_ms : 0;
+    pool->spin_count = attr ? attr->spin_count : 0;
+    if(pool->min_threads > thread_count) {
+        pool->min_threads = thread_count;
+    }
+    if(pool->max_threads < thread_count) {
+        pool->max_threads = thread_count;
+    }
 
     // alloc memory for thread and queue.
-    pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * thread_count);
-    pool->queue = (threadpool_task_t *)malloc(sizeof(threadpool_task_t) * queue_size);
+    pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * pool->max_threads);
+    if(pool->flags & THREADPOOL_LOCKFREE_QUEUE) {
+        pool->lfqueue = (threadpool_mpmc_t *)malloc(sizeof(threadpool_mpmc_t));
+        if(pool->lfqueue != NULL && threadpool_mpmc_init(pool->lfqueue, queue_size, -1) != THREADPOOL_OK) {
+            free(pool->lfqueue);
+            pool->lfqueue = NULL;
+        }
+    } else {
+        pool->queue = (threadpool_task_t *)malloc(sizeof(threadpool_task_t) * queue_size);
+    }
 
-    // init mutex and cond
-    if(pthread_mutex_init(&(pool->lock), NULL) != 0 ||
-       pthread_cond_init(&(pool->notify), NULL) != 0 ||
-       pool->threads == NULL || pool->queue == NULL) {
+    // init mutex and cond, timed waits for idle retirement and for queue
+    // space use the monotonic clock
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    int cond_err = pthread_cond_init(&(pool->notify), &condattr) |
+                   pthread_cond_init(&(pool->space), &condattr) |
+                   pthread_mutex_init(&(pool->space_lock), NULL) |
+                   pthread_mutex_init(&(pool->fiber_lock), NULL) |
+                   pthread_cond_init(&(pool->timer_wake), &condattr) |
+                   pthread_mutex_init(&(pool->timer_lock), NULL);
+    pthread_condattr_destroy(&condattr);
+    if(pthread_mutex_init(&(pool->lock), NULL) != 0 || cond_err != 0 ||
+       pool->threads == NULL || (pool->queue == NULL && pool->lfqueue == NULL)) {
         if(pool) {
             threadpool_destroy(pool, 0);
         }
         return NULL;
     }
 
-    // create work thread
+    // CPUs to pin workers to, round-robin
+    if(attr && attr->cpus != NULL && attr->cpu_count > 0) {
+        pool->cpus = (int *)malloc(sizeof(int) * attr->cpu_count);
+        if(pool->cpus == NULL) {
+            threadpool_destroy(pool, 0);
+            return NULL;
+        }
+        memcpy(pool->cpus, attr->cpus, sizeof(int) * attr->cpu_count);
+        pool->cpu_count = attr->cpu_count;
+    }
+
+    // per-node queues, each allocated on its node
+    if((pool->flags & THREADPOOL_NUMA) && threadpool_init_nodes(pool, queue_size) != THREADPOOL_OK) {
+        threadpool_destroy(pool, 0);
+        return NULL;
+    }
+
+    // queues for the high and background classes, normal tasks use the regular queues
+    if(pool->flags & THREADPOOL_PRIORITIES) {
+        for(int i = 0; i < THREADPOOL_PRIORITY_COUNT; i++) {
+            if(i == THREADPOOL_PRIORITY_NORMAL) {
+                continue;
+            }
+            pool->class_queues[i] = (threadpool_mpmc_t *)malloc(sizeof(threadpool_mpmc_t));
+            if(pool->class_queues[i] == NULL ||
+               threadpool_mpmc_init(pool->class_queues[i], queue_size, -1) != THREADPOOL_OK) {
+                free(pool->class_queues[i]);
+                pool->class_queues[i] = NULL;
+                threadpool_destroy(pool, 0);
+                return NULL;
+            }
+        }
+    }
+
+    // alloc per-worker state for every slot up to max_threads, with deques
+    // as large as the shared queue
+    if((pool->flags & (THREADPOOL_WORK_STEALING | THREADPOOL_LOCKFREE_QUEUE |
+                       THREADPOOL_NUMA | THREADPOOL_PRIORITIES | THREADPOOL_STATS)) ||
+       pool->max_threads > pool->min_threads || pool->spin_count > 0) {
+        pool->workers = (threadpool_worker_t *)calloc(pool->max_threads, sizeof(threadpool_worker_t));
+        if(pool->workers == NULL) {
+            threadpool_destroy(pool, 0);
+            return NULL;
+        }
+        for(int i = 0; i < pool->max_threads; i++) {
+            pool->workers[i].pool = pool;
+            pool->workers[i].index = i;
+            pool->workers[i].seed = (unsigned int)i * 2654435761u + 1;
+            pool->workers[i].node = -1;
+            if(pool->node_count > 0) {
+                // Pinned workers belong to their CPU's node, others are spread evenly
+                int node = -1;
+                if(pool->cpu_count > 0) {
+                    node = threadpool_node_of_cpu(pool, pool->cpus[i % pool->cpu_count]);
+                }
+                pool->workers[i].node = (node >= 0) ? node : i % pool->node_count;
+            }
+            if((pool->flags & THREADPOOL_WORK_STEALING) &&
+               threadpool_deque_init(&(pool->workers[i].deque), queue_size) != THREADPOOL_OK) {
+                threadpool_destroy(pool, 0);
+                return NULL;
+            }
+            pool->worker_count++;
+        }
+    }
+
+    // one counter block per worker slot plus one for helping threads
+    if(pool->flags & THREADPOOL_STATS) {
+        pool->stats = (threadpool_worker_stats_t *)calloc(pool->worker_count + 1,
+                                                          sizeof(threadpool_worker_stats_t));
+        if(pool->stats == NULL) {
+            threadpool_destroy(pool, 0);
+            return NULL;
+        }
+    }
+
+    // create work thread, holding the lock so no worker sees a partial thread_count
+    pthread_mutex_lock(&(pool->lock));
     for(int i = 0; i < thread_count; i++) {
-        if(pthread_create(&(pool->threads[i]), NULL, threadpool_thread, (void*)pool) != 0) {
+        void *(*routine)(void *) = threadpool_thread;
+        void *arg = (void *)pool;
+        if(pool->workers != NULL) {
+            routine = threadpool_worker_thread;
+            arg = (void *)&(pool->workers[i]);
+            pool->workers[i].state = THREADPOOL_SLOT_RUNNING;
+        }
+        if(threadpool_spawn(pool, i, routine, arg) != THREADPOOL_OK) {
+            if(pool->workers != NULL) {
+                pool->workers[i].state = THREADPOOL_SLOT_FREE;
+            }
+            pthread_mutex_unlock(&(pool->lock));
             threadpool_destroy(pool, 0);
             return NULL;
         }
-        pool->thread_count++;
+        __atomic_add_fetch(&(pool->thread_count), 1, __ATOMIC_RELAXED);
     }
+    pthread_mutex_unlock(&(pool->lock));
 
     return pool;
 }
@@ -147,7 +2674,10 @@ int threadpool_destroy(threadpool_t *pool, int flags)
     if(pool->shutdown) {
         err = THREADPOOL_ERR;
     } else {
-        pool->shutdown = (flags & 1) ? 1 : 2;
+        __atomic_store_n(&(pool->shutdown), (flags & 1) ? 1 : 2, __ATOMIC_RELAXED);
+
+        // Exiting workers decrement thread_count, so take it while still locked
+        int thread_count = pool->thread_count;
 
         // Wake up all threads
         if((pthread_cond_broadcast(&(pool->notify)) != 0) ||
@@ -155,10 +2685,34 @@ int threadpool_destroy(threadpool_t *pool, int flags)
             err = THREADPOOL_ERR;
         }
 
-        // Wait for all threads to complete
-        for(int i = 0; i < pool->thread_count; i++) {
-            if(pthread_join(pool->threads[i], NULL) != 0) {
-                err = THREADPOOL_ERR;
+        // Producers blocked on a full queue give up with THREADPOOL_ERR
+        pthread_mutex_lock(&(pool->space_lock));
+        pthread_cond_broadcast(&(pool->space));
+        pthread_mutex_unlock(&(pool->space_lock));
+
+        // No more firings
+        pthread_mutex_lock(&(pool->timer_lock));
+        pool->timer_stop = true;
+        pthread_cond_signal(&(pool->timer_wake));
+        pthread_mutex_unlock(&(pool->timer_lock));
+        if(pool->timer_started && pthread_join(pool->timer_thread, NULL) != 0) {
+            err = THREADPOOL_ERR;
+        }
+
+        // Wait for all threads to complete. With worker slots, threads live
+        // wherever the slot is in use, including retired ones not yet joined.
+        if(pool->workers != NULL) {
+            for(int i = 0; i < pool->worker_count; i++) {
+                if(__atomic_load_n(&(pool->workers[i].state), __ATOMIC_ACQUIRE) != THREADPOOL_SLOT_FREE &&
+                   pthread_join(pool->threads[i], NULL) != 0) {
+                    err = THREADPOOL_ERR;
+                }
+            }
+        } else {
+            for(int i = 0; i < thread_count; i++) {
+                if(pthread_join(pool->threads[i], NULL) != 0) {
+                    err = THREADPOOL_ERR;
+                }
             }
         }
     }
@@ -169,10 +2723,56 @@ int threadpool_destroy(threadpool_t *pool, int flags)
             free(pool->threads);
             pthread_mutex_destroy(&(pool->lock));
             pthread_cond_destroy(&(pool->notify));
+            pthread_mutex_destroy(&(pool->space_lock));
+            pthread_cond_destroy(&(pool->space));
+            pthread_mutex_destroy(&(pool->fiber_lock));
+            pthread_mutex_destroy(&(pool->timer_lock));
+            pthread_cond_destroy(&(pool->timer_wake));
         }
         if(pool->queue) {
             free(pool->queue);
         }
+        if(pool->lfqueue) {
+            threadpool_mpmc_free(pool->lfqueue);
+            free(pool->lfqueue);
+        }
+        if(pool->nodes) {
+            for(int i = 0; i < pool->node_count; i++) {
+                threadpool_mpmc_free(&(pool->nodes[i].queue));
+                free(pool->nodes[i].cpus);
+            }
+            free(pool->nodes);
+        }
+        for(int i = 0; i < THREADPOOL_PRIORITY_COUNT; i++) {
+            if(pool->class_queues[i]) {
+                threadpool_mpmc_free(pool->class_queues[i]);
+                free(pool->class_queues[i]);
+            }
+        }
+        // Timers still armed, handles not released are invalid from here on
+        if(pool->wheel) {
+            for(int i = 0; i < THREADPOOL_WHEEL_SLOTS; i++) {
+                while(pool->wheel[i].next != &(pool->wheel[i])) {
+                    threadpool_timer_t *timer = pool->wheel[i].next;
+                    threadpool_timer_unlink(timer);
+                    free(timer);
+                }
+            }
+            free(pool->wheel);
+        }
+        while(pool->fiber_cache != NULL) {
+            threadpool_fiber_t *fiber = pool->fiber_cache;
+            pool->fiber_cache = fiber->next;
+            threadpool_fiber_free(fiber);
+        }
+        free(pool->cpus);
+        free(pool->stats);
+        if(pool->workers) {
+            for(int i = 0; i < pool->worker_count; i++) {
+                free(pool->workers[i].deque.tasks);
+            }
+            free(pool->workers);
+        }
         free(pool);
     }
     
@@ -187,22 +2787,128 @@ void example_task(void *arg) {
     printf("Task %d finished\n", *num);
 }
 
+struct example_arg {
+    int num;
+    threadpool_waitgroup_t *wg;
+};
+
+void example_tracked_task(void *arg) {
+    struct example_arg *ea = (struct example_arg *)arg;
+    example_task(&ea->num);
+    threadpool_waitgroup_done(ea->wg);
+}
+
+// Work stealing with priorities: high tasks added behind a deque full of
+// normal tasks still run first
+static int example_order[40];
+static int example_ran;
+
+void example_record_task(void *arg) {
+    example_order[__atomic_fetch_add(&example_ran, 1, __ATOMIC_RELAXED)] = (int)(intptr_t)arg;
+}
+
+void example_fan_out_task(void *arg) {
+    threadpool_t *pool = (threadpool_t *)arg;
+    threadpool_task_opts_t high = { THREADPOOL_PRIORITY_HIGH, 0, NULL };
+    for(int i = 0; i < 32; i++) {
+        threadpool_add(pool, example_record_task, (void *)(intptr_t)0);
+    }
+    for(int i = 0; i < 4; i++) {
+        threadpool_add_ex(pool, example_record_task, (void *)(intptr_t)1, &high);
+    }
+}
+
+int example_priorities_with_stealing(void) {
+    threadpool_attr_t attr;
+    threadpool_attr_init(&attr);
+    attr.flags = THREADPOOL_WORK_STEALING | THREADPOOL_PRIORITIES;
+    threadpool_t *pool = threadpool_create_ex(1, 64, &attr);
+    if(pool == NULL) {
+        return 1;
+    }
+
+    threadpool_add(pool, example_fan_out_task, pool);
+    while(__atomic_load_n(&example_ran, __ATOMIC_RELAXED) < 36) {
+        usleep(1000);
+    }
+    threadpool_destroy(pool, 0);
+
+    // All four high tasks ran before the eighth take reserved for normal work
+    int high = 0;
+    for(int i = 0; i < 7; i++) {
+        high += example_order[i];
+    }
+    printf("High tasks first under work stealing: %s\n", high == 4 ? "yes" : "no");
+    return high == 4 ? 0 : 1;
+}
+
+// Work stealing with fibers: a yield lets the tasks the fiber pushed on
+// its worker's deque run before it continues
+static int example_local_done;
+static int example_fiber_done;
+
+void example_local_task(void *arg) {
+    (void)arg;
+    __atomic_add_fetch(&example_local_done, 1, __ATOMIC_RELAXED);
+}
+
+void example_yielding_fiber(void *arg) {
+    threadpool_t *pool = (threadpool_t *)arg;
+    for(int i = 0; i < 8; i++) {
+        threadpool_add(pool, example_local_task, NULL);
+    }
+    threadpool_fiber_yield();
+    printf("Local tasks done before the yield returned: %d of 8\n",
+           __atomic_load_n(&example_local_done, __ATOMIC_RELAXED));
+    __atomic_store_n(&example_fiber_done, __atomic_load_n(&example_local_done, __ATOMIC_RELAXED) + 1,
+                     __ATOMIC_RELEASE);
+}
+
+int example_yield_with_stealing(void) {
+    threadpool_attr_t attr;
+    threadpool_attr_init(&attr);
+    attr.flags = THREADPOOL_WORK_STEALING;
+    threadpool_t *pool = threadpool_create_ex(1, 64, &attr);
+    if(pool == NULL) {
+        return 1;
+    }
+
+    threadpool_fiber_spawn(pool, example_yielding_fiber, pool);
+    while(__atomic_load_n(&example_fiber_done, __ATOMIC_ACQUIRE) == 0) {
+        usleep(1000);
+    }
+    threadpool_destroy(pool, 0);
+    return example_fiber_done == 9 ? 0 : 1;
+}
+
 int main() {
+    if(example_priorities_with_stealing() != 0 || example_yield_with_stealing() != 0) {
+        return 1;
+    }
+
     threadpool_t *pool = threadpool_create(4, 100);
     if(pool == NULL) {
         printf("Failed to create thread pool\n");
         return 1;
     }
 
-    int task_args[20];
+    threadpool_waitgroup_t wg;
+    threadpool_waitgroup_init(&wg);
+
+    struct example_arg task_args[20];
     for(int i = 0; i < 20; i++) {
-        task_args[i] = i;
-        if(threadpool_add(pool, example_task, (void *)&task_args[i]) != 0) {
+        task_args[i].num = i;
+        task_args[i].wg = &wg;
+        threadpool_waitgroup_add(&wg, 1);
+        if(threadpool_add(pool, example_tracked_task, (void *)&task_args[i]) != 0) {
             printf("Failed to add task %d\n", i);
+            threadpool_waitgroup_done(&wg);
         }
     }
 
-    sleep(5);
+    // Runs queued tasks on this thread until all 20 are done
+    threadpool_waitgroup_wait(pool, &wg);
+    threadpool_waitgroup_destroy(&wg);
 
     if(threadpool_destroy(pool, 0) != 0) {
         printf("Failed to destroy thread pool\n");
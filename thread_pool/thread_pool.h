@@ -7,31 +7,353 @@ extern "C" {
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Creation flags (threadpool_attr_t.flags)
+#define THREADPOOL_WORK_STEALING 0x1  // Per-worker deques: tasks added from a worker stay local,
+                                      // idle workers steal from random victims
+#define THREADPOOL_LOCKFREE_QUEUE 0x2 // Shared queue is a lock-free bounded MPMC ring instead of
+                                      // the mutex-protected circular buffer
+#define THREADPOOL_NUMA 0x4           // Workers spread over NUMA nodes and pinned to them, each
+                                      // node with its own queue allocated on that node
+#define THREADPOOL_PRIORITIES 0x8     // Separate queues for high and background tasks
+                                      // (threadpool_add_ex)
+#define THREADPOOL_STATS 0x10         // Per-worker counters and latency histograms
+                                      // (threadpool_get_stats)
+
+// Overflow policies (threadpool_attr_t.overflow), what a submission does
+// when its queue is full
+#define THREADPOOL_OVERFLOW_REJECT 0      // Return THREADPOOL_FULL
+#define THREADPOOL_OVERFLOW_BLOCK 1       // Wait up to block_timeout_ms for a free slot, then
+                                          // THREADPOOL_FULL. Pool workers run the task inline.
+#define THREADPOOL_OVERFLOW_CALLER_RUNS 2 // Run the task on the submitting thread
+#define THREADPOOL_OVERFLOW_GROW 3        // Double the shared queue up to max_queue_size, then
+                                          // THREADPOOL_FULL (mutex-protected queue only)
+
+// Priority classes (threadpool_task_opts_t.priority)
+#define THREADPOOL_PRIORITY_HIGH 0
+#define THREADPOOL_PRIORITY_NORMAL 1
+#define THREADPOOL_PRIORITY_BACKGROUND 2
+#define THREADPOOL_PRIORITY_COUNT 3
+
+// Return codes
+#define THREADPOOL_FULL -2
+#define THREADPOOL_ERR -1
+#define THREADPOOL_OK 0
+
+#define THREADPOOL_CACHE_LINE 64
 
 typedef struct {
     void (*function)(void *);
     void *argument;
+    int64_t enqueue_ns;       // Submission time, set by the pool when THREADPOOL_STATS is on
 } threadpool_task_t;
 
+// Log-linear latency histogram: values below 16 are exact, larger ones fall
+// in one of 16 buckets per power of two (about 6% relative error)
+#define THREADPOOL_HISTOGRAM_SUB_BITS 4
+#define THREADPOOL_HISTOGRAM_BUCKETS ((64 - THREADPOOL_HISTOGRAM_SUB_BITS + 1) << THREADPOOL_HISTOGRAM_SUB_BITS)
+
+typedef struct {
+    uint64_t count;           // Values recorded
+    uint64_t sum;             // Sum of values, for the mean
+    uint64_t max;             // Largest value
+    uint64_t buckets[THREADPOOL_HISTOGRAM_BUCKETS];
+} threadpool_histogram_t;
+
+// Counters of one worker, or of the threads helping from outside the pool
+typedef struct {
+    uint64_t tasks;           // Tasks run
+    uint64_t steals;          // Tasks taken from other workers' deques
+    uint64_t busy_ns;         // Time spent running tasks
+    uint64_t idle_ns;         // Time spent spinning or parked
+    int64_t idle_since;       // Start of the current idle period, 0 while busy
+    threadpool_histogram_t wait_ns; // Time from submission to start
+    threadpool_histogram_t run_ns;  // Execution time
+} threadpool_worker_stats_t;
+
+// Pool-wide snapshot from threadpool_get_stats
+typedef struct {
+    int thread_count;         // Running workers
+    int idle;                 // Workers parked
+    int64_t queue_depth;      // Tasks waiting in the shared, node and class queues
+    int64_t queue_high_water; // Largest depth any queue reached
+    uint64_t rejected;        // Submissions refused with THREADPOOL_FULL
+    uint64_t completed;       // Tasks run
+    uint64_t steals;
+    uint64_t busy_ns;         // Summed over workers
+    uint64_t idle_ns;
+    threadpool_histogram_t wait_ns;
+    threadpool_histogram_t run_ns;
+} threadpool_stats_t;
+
+// Per-task options for threadpool_add_ex
+typedef struct {
+    int priority;             // THREADPOOL_PRIORITY_*, only NORMAL without THREADPOOL_PRIORITIES
+    int64_t deadline_ns;      // threadpool_clock_ns() time after which the task is not run (0 = none)
+    void (*expired)(void *);  // Called with the argument instead of the task once expired, may be NULL
+} threadpool_task_opts_t;
+
+// Timer of threadpool_add_delayed / threadpool_add_periodic, an entry of a
+// timing wheel slot list. Times are in wheel ticks of 1 ms.
+typedef struct threadpool_timer {
+    struct threadpool_timer *prev; // Slot list links, NULL once fired or cancelled
+    struct threadpool_timer *next;
+    void (*function)(void *);
+    void *argument;
+    uint64_t expires;         // Tick to fire at
+    uint64_t period;          // Ticks between firings, 0 for a one-shot timer
+    int refs;                 // Held by the caller's handle and by the wheel while armed
+} threadpool_timer_t;
+
+// Optional creation attributes, initialize with threadpool_attr_init()
+typedef struct {
+    int flags;                // THREADPOOL_* creation flags
+    int min_threads;          // Idle workers retire down to this many (0 = thread_count)
+    int max_threads;          // Workers are added up to this many while the queue a
+                              // task lands on (shared, node, class or a worker's
+                              // deque) backs up (0 = thread_count)
+    int idle_timeout_ms;      // Idle time before a worker above min_threads retires
+                              // (negative is rejected)
+    int spin_count;           // Rounds an idle worker spins, then yields, before
+                              // parking (0 = park immediately)
+    const int *cpus;          // CPUs to pin workers to, worker i on cpus[i % cpu_count]
+    int cpu_count;            // Number of entries in cpus (0 = no pinning)
+    int overflow;             // THREADPOOL_OVERFLOW_* policy
+    int block_timeout_ms;     // Longest wait with THREADPOOL_OVERFLOW_BLOCK (-1 = forever)
+    int max_queue_size;       // Bound for THREADPOOL_OVERFLOW_GROW
+    size_t fiber_stack_size;  // Stack size of fibers (0 = 64 KiB)
+} threadpool_attr_t;
+
+// Chase-Lev work-stealing deque with a fixed power-of-two capacity.
+// The owner pushes and pops at bottom, thieves steal from top.
+typedef struct {
+    int64_t top;              // Next index to steal, advanced by CAS
+    char pad0[THREADPOOL_CACHE_LINE - sizeof(int64_t)];
+    int64_t bottom;           // Next index to push, written by the owner only
+    char pad1[THREADPOOL_CACHE_LINE - sizeof(int64_t)];
+    threadpool_task_t *tasks; // Circular task buffer
+    int64_t mask;             // Capacity - 1
+} threadpool_deque_t;
+
+// Slot of the lock-free shared queue. seq == position means free for that
+// enqueue, seq == position + 1 means filled for that dequeue.
 typedef struct {
+    uint64_t seq;
+    threadpool_task_t task;
+} threadpool_slot_t;
+
+// Bounded MPMC queue (Vyukov) used with THREADPOOL_LOCKFREE_QUEUE
+typedef struct {
+    uint64_t enqueue_pos;     // Next position to fill, advanced by CAS
+    char pad0[THREADPOOL_CACHE_LINE - sizeof(uint64_t)];
+    uint64_t dequeue_pos;     // Next position to drain, advanced by CAS
+    char pad1[THREADPOOL_CACHE_LINE - sizeof(uint64_t)];
+    threadpool_slot_t *slots; // Power-of-two slot array
+    uint64_t mask;            // Capacity - 1
+    size_t map_size;          // Length of the slots mapping when placed on a node, else 0
+} threadpool_mpmc_t;
+
+// NUMA node of a THREADPOOL_NUMA pool
+typedef struct {
+    int id;                   // Kernel node id, -1 when NUMA information is unavailable
+    int *cpus;                // Usable CPUs of the node
+    int cpu_count;
+    threadpool_mpmc_t queue;  // Node-local task queue
+} threadpool_node_t;
+
+struct threadpool;
+
+// Fiber started by threadpool_fiber_spawn, opaque
+typedef struct threadpool_fiber threadpool_fiber_t;
+
+// Per-worker slot used in work-stealing, lock-free queue and dynamic modes
+typedef struct {
+    struct threadpool *pool;  // Owning pool
+    int index;                // Index in pool->workers
+    int state;                // Slot state, free / running / exited
+    int node;                 // Index in pool->nodes, -1 outside NUMA mode
+    unsigned int seed;        // Victim selection state
+    threadpool_deque_t deque; // Local task deque (work-stealing mode only)
+} threadpool_worker_t;
+
+typedef struct threadpool {
     pthread_mutex_t lock;     // Mutex for thread synchronization
     pthread_cond_t notify;    // Condition variable for task notification
     pthread_t *threads;       // Array of worker threads
-    threadpool_task_t *queue; // Task queue (circular buffer)
+    threadpool_task_t *queue; // Task queue (circular buffer), NULL in lock-free queue mode
     
-    int thread_count;         // Number of worker threads
+    int thread_count;         // Number of running worker threads
     int queue_size;           // Maximum capacity of task queue
     int head;                 // Index of first element in queue
     int tail;                 // Index of next available slot in queue
-    int count;                // Current number of pending tasks
+    int count;                // Current number of pending tasks (circular buffer only)
     int shutdown;             // Flag indicating shutdown status:
                               // 0 = running, 1 = immediate shutdown, 
                               // 2 = graceful shutdown
+
+    int flags;                // Creation flags
+    int idle;                 // Number of workers sleeping on notify
+    threadpool_worker_t *workers; // Per-worker slots, max_threads of them (NULL in classic mode)
+    int worker_count;         // Number of entries in workers
+    threadpool_mpmc_t *lfqueue; // Shared queue in lock-free queue mode
+    int min_threads;          // Lower bound for thread_count
+    int max_threads;          // Upper bound for thread_count
+    int idle_timeout_ms;      // Idle time before retiring a thread above min_threads
+    int spin_count;           // Spin/yield rounds before an idle worker parks
+    int *cpus;                // CPUs workers are pinned to, round-robin
+    int cpu_count;
+    threadpool_node_t *nodes; // NUMA nodes (THREADPOOL_NUMA only)
+    int node_count;
+    threadpool_mpmc_t *class_queues[THREADPOOL_PRIORITY_COUNT]; // High and background queues
+                              // (THREADPOOL_PRIORITIES only), NULL for normal
+    threadpool_worker_stats_t *stats; // worker_count + 1 entries, the last for helping
+                              // threads (THREADPOOL_STATS only)
+    int64_t queue_high_water; // Largest queue depth seen
+    uint64_t rejected;        // THREADPOOL_FULL returns
+    int overflow;             // THREADPOOL_OVERFLOW_* policy
+    int block_timeout_ms;
+    int max_queue_size;
+    pthread_mutex_t space_lock;
+    pthread_cond_t space;     // Broadcast when a task leaves a queue while producers wait
+    int space_waiters;        // Producers blocked on a full queue
+    size_t fiber_stack_size;  // Usable stack of each fiber
+    pthread_mutex_t fiber_lock; // Protects fiber_cache
+    threadpool_fiber_t *fiber_cache; // Finished fibers kept with their stacks for reuse
+    int fiber_cached;         // Number of entries in fiber_cache
+    pthread_mutex_t timer_lock; // Protects the timing wheel
+    pthread_cond_t timer_wake; // Signalled when a timer is due before timer_next
+    pthread_t timer_thread;   // Moves due timers to the queue, started with the first timer
+    bool timer_started;
+    bool timer_stop;
+    threadpool_timer_t *wheel; // Slot list heads of the hierarchical timing wheel
+    int64_t timer_base;       // threadpool_clock_ns() time of tick 0
+    uint64_t timer_tick;      // Next tick to process
+    uint64_t timer_next;      // Tick the timer thread sleeps until
+    int timer_count;          // Timers in the wheel
 } threadpool_t;
 
+// Counter of outstanding tasks. The last done() takes the lock, so the
+// others finish without touching it.
+typedef struct {
+    int pending;              // Tasks not yet done
+    int waiters;              // Threads blocked in threadpool_waitgroup_wait
+    threadpool_fiber_t *fibers; // Fibers parked in threadpool_waitgroup_wait
+    pthread_mutex_t lock;
+    pthread_cond_t done;      // Broadcast when pending drops to zero
+} threadpool_waitgroup_t;
+
+// Result handle returned by threadpool_submit
+typedef struct {
+    void *(*function)(void *);
+    void *argument;
+    void *result;             // Return value of function, valid once ready
+    threadpool_waitgroup_t wg;
+} threadpool_future_t;
+
+void threadpool_attr_init(threadpool_attr_t *attr);
 threadpool_t *threadpool_create(int thread_count, int queue_size);
+threadpool_t *threadpool_create_ex(int thread_count, int queue_size, const threadpool_attr_t *attr);
 int threadpool_add(threadpool_t *pool, void (*function)(void *), void *argument);
+// Queue up to count tasks with a single publish and wake at most
+// min(count, idle) workers. Tasks that do not fit go through the overflow
+// policy. Returns the number queued (or run inline), which is less than
+// count when the queue fills up, or THREADPOOL_ERR.
+int threadpool_add_batch(threadpool_t *pool, const threadpool_task_t *tasks, int count);
+// threadpool_add with a priority class and/or deadline. High tasks are taken
+// before normal ones and normal before background, with every 8th take
+// starting at normal and every 16th at background so no class starves.
+// Expired tasks are dropped when dequeued, after calling opts->expired.
+int threadpool_add_ex(threadpool_t *pool, void (*function)(void *), void *argument,
+                      const threadpool_task_opts_t *opts);
+// CLOCK_MONOTONIC time in nanoseconds, the clock for deadline_ns
+int64_t threadpool_clock_ns(void);
+// Queue a task on a node's queue (THREADPOOL_NUMA). node indexes pool->nodes,
+// which is ordered by kernel node id. Workers of that node take it first.
+int threadpool_add_node(threadpool_t *pool, int node, void (*function)(void *), void *argument);
+int threadpool_node_count(threadpool_t *pool);
+// Node index of the calling worker, -1 outside the pool or NUMA mode
+int threadpool_current_node(threadpool_t *pool);
 int threadpool_destroy(threadpool_t *pool, int flags);
+// Wait until the shared queue has a free slot: THREADPOOL_OK, THREADPOOL_FULL
+// after timeout_ms (-1 = forever), THREADPOOL_ERR once the pool shuts down
+int threadpool_wait_capacity(threadpool_t *pool, int timeout_ms);
+
+// Statistics (THREADPOOL_STATS), THREADPOOL_ERR when disabled. Counters are
+// kept per worker and summed here, so reading never blocks the workers.
+int threadpool_get_stats(threadpool_t *pool, threadpool_stats_t *stats);
+// index is the worker slot, worker_count for threads helping from outside
+int threadpool_get_worker_stats(threadpool_t *pool, int index, threadpool_worker_stats_t *stats);
+// Upper bound of the bucket holding the given percentile (0-100)
+uint64_t threadpool_histogram_percentile(const threadpool_histogram_t *hist, double percentile);
+
+// Wait-group: add() before submitting, done() at the end of each task,
+// wait() until the count drops to zero
+int threadpool_waitgroup_init(threadpool_waitgroup_t *wg);
+void threadpool_waitgroup_destroy(threadpool_waitgroup_t *wg);
+void threadpool_waitgroup_add(threadpool_waitgroup_t *wg, int count);
+void threadpool_waitgroup_done(threadpool_waitgroup_t *wg);
+// Runs queued tasks of pool (may be NULL) on the calling thread while waiting.
+// A fiber parks instead, leaving its worker free.
+void threadpool_waitgroup_wait(threadpool_t *pool, threadpool_waitgroup_t *wg);
+
+// Queue function(argument) and return a handle for its result.
+// Returns NULL with errno EAGAIN when the queue is full, EINVAL on error.
+threadpool_future_t *threadpool_submit(threadpool_t *pool, void *(*function)(void *), void *argument);
+bool threadpool_future_ready(threadpool_future_t *future);
+// Wait for the task, helping with queued tasks meanwhile, and return its result
+void *threadpool_future_get(threadpool_t *pool, threadpool_future_t *future);
+// Only valid once the task has finished (future_get or future_ready)
+void threadpool_future_destroy(threadpool_future_t *future);
+
+// Fibers: tasks with their own pooled stack, run by the workers, that can
+// suspend without holding a worker. A fiber may resume on a different worker
+// than it suspended on. Fibers still parked or queued when the pool is
+// destroyed are leaked.
+// Start function(argument) on a new fiber, THREADPOOL_OK/FULL/ERR like threadpool_add
+int threadpool_fiber_spawn(threadpool_t *pool, void (*function)(void *), void *argument);
+// Fiber running on the calling thread, NULL outside fibers
+threadpool_fiber_t *threadpool_fiber_self(void);
+// Let queued tasks, the worker's local ones included, run and continue
+// later, sched_yield() outside fibers
+void threadpool_fiber_yield(void);
+// Suspend the calling fiber. Once its stack is switched out, park(fiber, ctx)
+// runs on the worker and must arrange for threadpool_fiber_wake(fiber) to be
+// called exactly once, possibly right away. THREADPOOL_ERR outside fibers.
+int threadpool_fiber_park(void (*park)(threadpool_fiber_t *, void *), void *ctx);
+// Queue a parked fiber to continue
+void threadpool_fiber_wake(threadpool_fiber_t *fiber);
+
+// Run function(argument) once after delay_ms, or every period_ms starting
+// period_ms from now. One timer thread per pool moves due tasks into the queue
+// in batches with 1 ms resolution. The overflow policy does not apply: a
+// firing that finds the queue full is retried on the next tick. When
+// timer is not NULL it receives a handle, to be released with
+// threadpool_timer_cancel() before the pool is destroyed.
+int threadpool_add_delayed(threadpool_t *pool, int64_t delay_ms, void (*function)(void *), void *argument,
+                           threadpool_timer_t **timer);
+int threadpool_add_periodic(threadpool_t *pool, int64_t period_ms, void (*function)(void *), void *argument,
+                            threadpool_timer_t **timer);
+// Stop the timer and release the handle. THREADPOOL_OK when it was still
+// armed, THREADPOOL_ERR when a one-shot timer already fired. A firing
+// already queued still runs.
+int threadpool_timer_cancel(threadpool_t *pool, threadpool_timer_t *timer);
+
+// Call fn(chunk_begin, chunk_end, ctx) over [begin, end). Chunks of grain
+// items (grain <= 0 picks one) are split off lazily, only while other threads
+// are short of work. The calling thread processes chunks too and returns once
+// the whole range is done. pool may be NULL to run serially.
+int threadpool_parallel_for(threadpool_t *pool, int64_t begin, int64_t end, int64_t grain,
+                            void (*fn)(int64_t, int64_t, void *), void *ctx);
+// Like threadpool_parallel_for, with fn(chunk_begin, chunk_end, acc, ctx)
+// accumulating into a result_size-byte accumulator. result holds the identity
+// on entry and the total on return; join(acc, other, ctx) folds other into acc
+// and must be associative and commutative.
+int threadpool_parallel_reduce(threadpool_t *pool, int64_t begin, int64_t end, int64_t grain,
+                               void (*fn)(int64_t, int64_t, void *, void *),
+                               void (*join)(void *, const void *, void *),
+                               void *result, size_t result_size, void *ctx);
 
 #ifdef __cplusplus
 }